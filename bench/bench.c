@@ -0,0 +1,177 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_RUNS 5
+#define BENCH_MIN_NSECS 100*1000*1000
+#define BENCH_MAX_RESULTS 64
+
+/* The cycles come from the CPU cycles counter when perf events are allowed,
+ * otherwise from the TSC which counts at a constant rate regardless of the
+ * actual CPU frequency.
+ */
+enum cycles_source {
+	CYCLES_NONE,
+	CYCLES_TSC,
+	CYCLES_PMU,
+};
+
+struct bench_result {
+	char name[64];
+	uint64_t iters;
+	double ns_per_op;
+	double cycles_per_op;
+};
+
+static struct bench_result results[BENCH_MAX_RESULTS];
+static int num_results;
+static enum cycles_source cycles_source;
+static int cycles_fd = -1;
+static const char *filter;
+
+static uint64_t now_nsecs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void cycles_init(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	cycles_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (cycles_fd >= 0) {
+		cycles_source = CYCLES_PMU;
+		return;
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	cycles_source = CYCLES_TSC;
+#else
+	cycles_source = CYCLES_NONE;
+#endif
+}
+
+static uint64_t cycles_now(void)
+{
+	uint64_t val = 0;
+
+	switch (cycles_source) {
+		case CYCLES_PMU:
+			if (read(cycles_fd, &val, sizeof(val)) != sizeof(val))
+				val = 0;
+			break;
+		case CYCLES_TSC:
+#if defined(__x86_64__) || defined(__i386__)
+			val = __rdtsc();
+#endif
+			break;
+		case CYCLES_NONE:
+			break;
+	}
+
+	return val;
+}
+
+void bench_run(const char *name, bench_fn fn, void *arg)
+{
+	if (filter && !strstr(name, filter))
+		return;
+
+	if (num_results == BENCH_MAX_RESULTS) {
+		fprintf(stderr, "Too many benchmarks, %s skipped\n", name);
+		return;
+	}
+
+	// Warm up and find how many iterations take long enough to measure
+	uint64_t iters = 1;
+	while (1) {
+		uint64_t start = now_nsecs();
+		fn(arg, iters);
+		uint64_t elapsed = now_nsecs() - start;
+		if (elapsed >= BENCH_MIN_NSECS / BENCH_RUNS)
+			break;
+		iters *= 2;
+	}
+
+	struct bench_result *res = &results[num_results++];
+	snprintf(res->name, sizeof(res->name), "%s", name);
+	res->iters = iters;
+	res->ns_per_op = -1;
+
+	int run;
+	for (run = 0; run < BENCH_RUNS; run++) {
+		uint64_t start_cycles = cycles_now();
+		uint64_t start = now_nsecs();
+		fn(arg, iters);
+		uint64_t elapsed = now_nsecs() - start;
+		uint64_t cycles = cycles_now() - start_cycles;
+
+		// The best run is the one least disturbed by the rest of the system
+		double ns_per_op = (double)elapsed / iters;
+		if (res->ns_per_op < 0 || ns_per_op < res->ns_per_op) {
+			res->ns_per_op = ns_per_op;
+			res->cycles_per_op = (double)cycles / iters;
+		}
+	}
+
+	fprintf(stderr, "%-40s %12.1f ns/op %12.1f cycles/op\n", res->name, res->ns_per_op, res->cycles_per_op);
+}
+
+static void bench_report(void)
+{
+	static const char *cycles_names[] = {
+		[CYCLES_NONE] = "none",
+		[CYCLES_TSC] = "tsc",
+		[CYCLES_PMU] = "pmu",
+	};
+	int i;
+
+	printf("{\n  \"cycles_source\": \"%s\",\n  \"benchmarks\": [\n", cycles_names[cycles_source]);
+	for (i = 0; i < num_results; i++) {
+		struct bench_result *res = &results[i];
+		printf("    {\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.2f, \"cycles_per_op\": %.2f}%s\n",
+				res->name, (unsigned long)res->iters, res->ns_per_op, res->cycles_per_op,
+				i + 1 < num_results ? "," : "");
+	}
+	printf("  ]\n}\n");
+}
+
+/* Usage: microbench [name-filter] > results.json
+ * The JSON goes to stdout, a readable summary to stderr.
+ */
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		filter = argv[1];
+
+	cycles_init();
+
+	bench_cache();
+	bench_conn();
+	bench_web();
+	bench_mime();
+	bench_parser();
+
+	bench_report();
+	return 0;
+}
@@ -0,0 +1,17 @@
+#include <stdint.h>
+
+/* A benchmark runs its operation iters times, the harness picks the number of
+ * iterations and reports the best of several runs.
+ */
+typedef void (*bench_fn)(void *arg, uint64_t iters);
+
+void bench_run(const char *name, bench_fn fn, void *arg);
+
+// Keep the compiler from optimizing away a result
+#define BENCH_KEEP(x) __asm__ volatile("" : : "g"(x) : "memory")
+
+void bench_cache(void);
+void bench_conn(void);
+void bench_web(void);
+void bench_mime(void);
+void bench_parser(void);
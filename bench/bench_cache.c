@@ -0,0 +1,143 @@
+/* The cache internals are static, benchmark them from inside the module */
+#include "src/cache.c"
+#include "bench.h"
+
+static const int occupancies[] = { 16, 64, CACHE_SIZE };
+
+static void cache_item_name(char *name, int name_len, int i)
+{
+	snprintf(name, name_len, "static/js/vendor-%03d.min.js", i);
+}
+
+/* Fill the cache with num_items loaded items, without touching the
+ * filesystem.
+ */
+static void cache_fill(int num_items)
+{
+	int i;
+
+	for (i = 0; i < shared->max_cache_items; i++)
+		free_buf(item_buf(&shared->cache[i]));
+	memset(shared->cache, 0, sizeof(shared->cache));
+	shared->max_cache_items = 0;
+
+	for (i = 0; i < num_items; i++) {
+		char name[64];
+		cache_item_name(name, sizeof(name), i);
+
+		struct cache_item *item = cache_item_alloc(name);
+		item->refresh_counter = shared->refresh_counter;
+		item->stbuf.st_size = 4096;
+		item->stbuf.st_mtime = 1400000000;
+		calc_last_modified(item->last_modified, sizeof(item->last_modified), item->stbuf.st_mtime);
+		item_set_buf(item, alloc_buf());
+	}
+}
+
+/* Attach content to a new item the way cache_load does once the file is read */
+static struct cache_item *check_load(const char *name, const char *content)
+{
+	struct cache_item *item = cache_item_alloc(name);
+	struct buf_item *buf = alloc_buf();
+	off_t size = strlen(content);
+	uint64_t hash;
+
+	memcpy(buf_data(buf), content, size);
+	buf = cache_share(item, buf, size, &hash);
+	item_set_buf(item, buf);
+	item->content_hash = hash;
+	item->stbuf.st_size = size;
+	item->refresh_counter = shared->refresh_counter;
+	return item;
+}
+
+// Not a benchmark, the microbench fails if files with the same content don't share a buffer
+static void check_cache_dedup(void)
+{
+	cache_fill(0);
+
+	struct cache_item *a = check_load("static/js/a.min.js", "function a() { return 1; }");
+	struct cache_item *b = check_load("vendor/js/a.min.js", "function a() { return 1; }");
+	struct cache_item *c = check_load("static/js/c.min.js", "function c() { return 1; }");
+
+	if (a->buf_id != b->buf_id || a->buf_id == c->buf_id) {
+		fprintf(stderr, "Cache dedup check failed: buf_id a=%d b=%d c=%d\n", a->buf_id, b->buf_id, c->buf_id);
+		exit(1);
+	}
+}
+
+static void bench_cache_find(void *arg, uint64_t iters)
+{
+	const char *filename = arg;
+	uint64_t i;
+
+	for (i = 0; i < iters; i++) {
+		struct cache_item *item = cache_find(filename);
+		BENCH_KEEP(item);
+	}
+}
+
+static void bench_cache_get_release(void *arg, uint64_t iters)
+{
+	const char *filename = arg;
+	char last_modified[32];
+	uint64_t i;
+
+	for (i = 0; i < iters; i++) {
+		off_t file_size;
+		void *release_data;
+		int fd;
+
+		const char *buf = cache_get(filename, &file_size, last_modified, &fd, &release_data);
+		BENCH_KEEP(buf);
+		cache_release(release_data);
+	}
+}
+
+static void bench_calc_last_modified(void *arg, uint64_t iters)
+{
+	char last_modified[32];
+	uint64_t i;
+
+	(void)arg;
+
+	for (i = 0; i < iters; i++) {
+		calc_last_modified(last_modified, sizeof(last_modified), 1400000000 + i);
+		BENCH_KEEP(last_modified);
+	}
+}
+
+void bench_cache(void)
+{
+	unsigned i;
+
+	cache_init(false, -1);
+	cache_owner_alloc();
+	check_cache_dedup();
+
+	for (i = 0; i < sizeof(occupancies) / sizeof(occupancies[0]); i++) {
+		int num_items = occupancies[i];
+		char bench_name[64];
+		char first[64];
+		char last[64];
+
+		cache_fill(num_items);
+		cache_item_name(first, sizeof(first), 0);
+		cache_item_name(last, sizeof(last), num_items - 1);
+
+		snprintf(bench_name, sizeof(bench_name), "cache_find/first/%d", num_items);
+		bench_run(bench_name, bench_cache_find, first);
+		snprintf(bench_name, sizeof(bench_name), "cache_find/last/%d", num_items);
+		bench_run(bench_name, bench_cache_find, last);
+		snprintf(bench_name, sizeof(bench_name), "cache_find/miss/%d", num_items);
+		bench_run(bench_name, bench_cache_find, "static/js/missing.min.js");
+	}
+
+	// A hit in the middle of a typically filled cache
+	char middle[64];
+	cache_fill(64);
+	cache_item_name(middle, sizeof(middle), 32);
+	bench_run("cache_get_release/hit/64", bench_cache_get_release, middle);
+
+	bench_run("calc_last_modified", bench_calc_last_modified, NULL);
+}
@@ -0,0 +1,185 @@
+/* The latency of a small response while a large transfer runs on the same wire
+ * thread. The transfer gives way to the others every send quantum, and a shaped
+ * one sleeps off its rate without holding them up.
+ */
+#include "src/conn.h"
+#include "bench.h"
+
+#include "wire.h"
+#include "wire_fd.h"
+#include "wire_stack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define LARGE_CHUNK_SIZE 64*1024
+#define SHAPED_RATE 64*1024*1024
+
+// Sent by the bench on the small connection, each is answered by the response
+enum bench_cmd {
+	CMD_PING = 'p',
+	CMD_LARGE = 'l',
+	CMD_SHAPED = 's',
+	CMD_STOP = 'x',
+};
+
+static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello";
+
+static wire_thread_t bench_thread;
+static wire_t small_wire;
+static wire_t large_wire;
+static wire_wait_t large_done;
+static bool large_running;
+static bool large_shaped;
+static int client_fd = -1;
+
+static void *large_drain_run(void *arg)
+{
+	char buf[LARGE_CHUNK_SIZE];
+	int fd = (long)arg;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	close(fd);
+	return NULL;
+}
+
+static void large_run(void *arg)
+{
+	static char chunk[LARGE_CHUNK_SIZE];
+	struct conn conn;
+
+	conn_set_rate_limit(large_shaped ? SHAPED_RATE : 0);
+	conn_init(&conn, (long)arg);
+	conn_set_rate_limit(0);
+
+	while (large_running && buf_write(&conn, chunk, sizeof(chunk)) == 0)
+		;
+
+	conn_close(&conn);
+	wire_wait_resume(&large_done);
+}
+
+static void large_start(bool shaped)
+{
+	int fds[2];
+	pthread_t tid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 ||
+			pthread_create(&tid, NULL, large_drain_run, (void *)(long)fds[1]) != 0) {
+		perror("Failed to start the large transfer");
+		exit(1);
+	}
+	pthread_detach(tid);
+
+	large_running = true;
+	large_shaped = shaped;
+	wire_wait_init(&large_done);
+	wire_init(&large_wire, "bench large", large_run, (void *)(long)fds[0], WIRE_STACK_ALLOC(16384));
+}
+
+static void large_stop(void)
+{
+	large_running = false;
+	wire_wait_single(&large_done);
+}
+
+static void small_run(void *arg)
+{
+	struct conn conn;
+	char cmd;
+
+	conn_init(&conn, (long)arg);
+
+	while (1) {
+		int ret = conn_read(&conn, &cmd, 1);
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+			wire_fd_mode_read(&conn.fd_state);
+			wire_fd_wait(&conn.fd_state);
+			wire_fd_mode_none(&conn.fd_state);
+			continue;
+		} else if (ret <= 0) {
+			break;
+		}
+
+		if (cmd == CMD_LARGE || cmd == CMD_SHAPED)
+			large_start(cmd == CMD_SHAPED);
+		else if (cmd == CMD_STOP)
+			large_stop();
+
+		if (buf_write(&conn, response, sizeof(response) - 1) < 0)
+			break;
+	}
+
+	conn_close(&conn);
+}
+
+static void *bench_thread_run(void *arg)
+{
+	wire_thread_init(&bench_thread);
+	wire_fd_init();
+	conn_start();
+	wire_init(&small_wire, "bench small", small_run, arg, WIRE_STACK_ALLOC(16384));
+	wire_thread_run();
+	return NULL;
+}
+
+static void small_request(char cmd)
+{
+	char buf[sizeof(response)];
+	size_t len = 0;
+
+	if (write(client_fd, &cmd, 1) != 1) {
+		perror("Failed to send to the bench wire thread");
+		exit(1);
+	}
+
+	while (len < sizeof(response) - 1) {
+		ssize_t ret = read(client_fd, buf + len, sizeof(response) - 1 - len);
+		if (ret <= 0) {
+			fprintf(stderr, "The bench wire thread closed the connection\n");
+			exit(1);
+		}
+		len += ret;
+	}
+}
+
+static void bench_small_hit(void *arg, uint64_t iters)
+{
+	uint64_t i;
+
+	(void)arg;
+
+	for (i = 0; i < iters; i++)
+		small_request(CMD_PING);
+}
+
+void bench_conn(void)
+{
+	int fds[2];
+	pthread_t tid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 ||
+			pthread_create(&tid, NULL, bench_thread_run, (void *)(long)fds[1]) != 0) {
+		perror("Failed to start the bench wire thread");
+		exit(1);
+	}
+	pthread_detach(tid);
+	client_fd = fds[0];
+
+	bench_run("conn/small_hit/alone", bench_small_hit, NULL);
+
+	small_request(CMD_LARGE);
+	bench_run("conn/small_hit/next_to_large", bench_small_hit, NULL);
+	small_request(CMD_STOP);
+
+	small_request(CMD_SHAPED);
+	bench_run("conn/small_hit/next_to_shaped", bench_small_hit, NULL);
+	small_request(CMD_STOP);
+
+	close(client_fd);
+}
@@ -0,0 +1,56 @@
+#include "bench.h"
+#include "src/mime.h"
+#include "src/gperf.h"
+
+#include <string.h>
+
+static const char *filenames[] = {
+	"index.html",
+	"static/css/site.css",
+	"static/js/vendor.min.js",
+	"images/logo.png",
+	"downloads/release-1.2.tar.gz",
+	"README",
+	"fonts/icons.woff2",
+	"data/export.unknownsuffix",
+};
+
+#define NUM_FILENAMES (sizeof(filenames) / sizeof(filenames[0]))
+
+static const char *suffixes[] = { "html", "css", "js", "png", "gz", "woff2", "json", "unknownsuffix" };
+
+#define NUM_SUFFIXES (sizeof(suffixes) / sizeof(suffixes[0]))
+
+static void bench_content_type(void *arg, uint64_t iters)
+{
+	uint64_t i;
+
+	(void)arg;
+
+	for (i = 0; i < iters; i++) {
+		const char *content_type = content_type_from_filename(filenames[i % NUM_FILENAMES]);
+		BENCH_KEEP(content_type);
+	}
+}
+
+static void bench_suffix_lookup(void *arg, uint64_t iters)
+{
+	int lens[NUM_SUFFIXES];
+	uint64_t i;
+
+	(void)arg;
+
+	for (i = 0; i < NUM_SUFFIXES; i++)
+		lens[i] = strlen(suffixes[i]);
+
+	for (i = 0; i < iters; i++) {
+		const char *mime = mime_from_suffix_name(suffixes[i % NUM_SUFFIXES], lens[i % NUM_SUFFIXES]);
+		BENCH_KEEP(mime);
+	}
+}
+
+void bench_mime(void)
+{
+	bench_run("content_type_from_filename", bench_content_type, NULL);
+	bench_run("mime_from_suffix_name", bench_suffix_lookup, NULL);
+}
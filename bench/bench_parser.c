@@ -0,0 +1,105 @@
+#include "bench.h"
+#include "http_parser.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Requests as captured from the common clients, the callbacks only look at the
+ * data like the server callbacks do so the parser itself dominates.
+ */
+struct corpus {
+	const char *name;
+	const char *data;
+};
+
+static const struct corpus corpora[] = {
+	{ "curl",
+		"GET /index.html HTTP/1.1\r\n"
+		"Host: localhost:9090\r\n"
+		"User-Agent: curl/7.81.0\r\n"
+		"Accept: */*\r\n"
+		"\r\n" },
+	{ "browser",
+		"GET /static/js/vendor.min.js HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"Connection: keep-alive\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+		"sec-ch-ua-platform: \"Linux\"\r\n"
+		"Accept: */*\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-Mode: no-cors\r\n"
+		"Sec-Fetch-Dest: script\r\n"
+		"Referer: https://www.example.com/\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Accept-Language: en-US,en;q=0.9\r\n"
+		"Cookie: session=3f2a1c9e8b7d6a5f4e3d2c1b0a998877; theme=dark; _ga=GA1.1.1234567890.1700000000\r\n"
+		"If-Modified-Since: Tue, 13 May 2014 16:53:20 GMT\r\n"
+		"\r\n" },
+	{ "pipelined",
+		"GET /a.css HTTP/1.1\r\nHost: localhost\r\nAccept: text/css\r\n\r\n"
+		"GET /b.js HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n\r\n"
+		"GET /c.png HTTP/1.1\r\nHost: localhost\r\nAccept: image/png\r\n\r\n" },
+	{ "h2c_upgrade",
+		"GET / HTTP/1.1\r\n"
+		"Host: localhost:9090\r\n"
+		"User-Agent: curl/7.81.0\r\n"
+		"Accept: */*\r\n"
+		"Connection: Upgrade, HTTP2-Settings\r\n"
+		"Upgrade: h2c\r\n"
+		"HTTP2-Settings: AAMAAABkAAQCAAAAAAIAAAAA\r\n"
+		"\r\n" },
+};
+
+#define NUM_CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+static int on_data(http_parser *parser, const char *at, size_t length)
+{
+	unsigned *sum = parser->data;
+	*sum += length + (unsigned char)at[0];
+	return 0;
+}
+
+static int on_message_complete(http_parser *parser)
+{
+	unsigned *sum = parser->data;
+	(*sum)++;
+	return 0;
+}
+
+static const struct http_parser_settings parser_settings = {
+	.on_message_complete = on_message_complete,
+	.on_url = on_data,
+	.on_header_field = on_data,
+	.on_header_value = on_data,
+};
+
+static void bench_parse(void *arg, uint64_t iters)
+{
+	const struct corpus *corpus = arg;
+	size_t len = strlen(corpus->data);
+	unsigned sum = 0;
+	uint64_t i;
+
+	for (i = 0; i < iters; i++) {
+		http_parser parser;
+		http_parser_init(&parser, HTTP_REQUEST);
+		parser.data = &sum;
+		size_t processed = http_parser_execute(&parser, &parser_settings, corpus->data, len);
+		BENCH_KEEP(processed);
+	}
+
+	BENCH_KEEP(sum);
+}
+
+void bench_parser(void)
+{
+	unsigned i;
+
+	for (i = 0; i < NUM_CORPORA; i++) {
+		char bench_name[64];
+		snprintf(bench_name, sizeof(bench_name), "http_parser/%s", corpora[i].name);
+		bench_run(bench_name, bench_parse, (void *)&corpora[i]);
+	}
+}
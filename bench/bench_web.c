@@ -0,0 +1,43 @@
+/* The response formatting is static in main.c, benchmark it from inside */
+#define main wire_httpd_main
+#include "src/main.c"
+#undef main
+#include "bench.h"
+
+struct header_args {
+	http_parser parser;
+	const char *filename;
+};
+
+static void bench_format_header(void *arg, uint64_t iters)
+{
+	struct header_args *args = arg;
+	char data[2048];
+	uint64_t i;
+
+	for (i = 0; i < iters; i++) {
+		int len = format_header(&args->parser, data, sizeof(data), 200, "OK", args->filename, 4096 + i,
+				"Tue, 13 May 2014 16:53:20 GMT");
+		BENCH_KEEP(len);
+		BENCH_KEEP(data);
+	}
+}
+
+void bench_web(void)
+{
+	struct header_args args;
+
+	http_parser_init(&args.parser, HTTP_REQUEST);
+	args.parser.http_major = 1;
+	args.parser.http_minor = 1;
+
+	args.filename = "static/js/vendor.min.js";
+	bench_run("send_header/format/js", bench_format_header, &args);
+
+	args.filename = "index.html";
+	bench_run("send_header/format/html", bench_format_header, &args);
+
+	// An HTTP/1.0 client gets a downgraded status line and Connection: close
+	args.parser.http_minor = 0;
+	bench_run("send_header/format/http10", bench_format_header, &args);
+}
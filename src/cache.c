@@ -1,4 +1,6 @@
 #include "cache.h"
+#include "prefork.h"
+#include "state.h"
 #include "xlog.h"
 
 #include "wire_io.h"
@@ -17,24 +19,95 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 
 #define CACHE_SIZE 256
 #define SPARE_BUFFERS 64
 #define NUM_BUFFERS (CACHE_SIZE + SPARE_BUFFERS)
 #define BUFFER_SIZE 1024*1024
+#define DEDUP_CHUNK_SIZE 4096
 
+/* Every process using the cache has an owner slot, the references it holds and
+ * the loads it does are recorded under it so they can be taken back when it
+ * dies. The workers of two servers share the cache during an upgrade.
+ */
+#define CACHE_OWNERS (4*MAX_WORKERS)
+
+/* The hot-set is a list of the cached files ordered by the number of hits
+ * they got, it is written periodically and at shutdown and is used on the next
+ * start to preload the cache before the requests come in.
+ */
+#define HOTSET_FILE "hotset"
+#define HOTSET_SAVE_TICKS 10
+#define HOTSET_BUF_SIZE (CACHE_SIZE * 272)
+#define WARMUP_WIRES 8
+
+/* Files that are not found are remembered for a short while so that repeated
+ * requests for them (scanners, broken links) are answered without going to the
+ * filesystem. An entry goes away when its TTL passes or, if its directory is
+ * watched, when the file is created. Only the directories of files in the cache
+ * are watched, they are known to exist and are in the dentry cache, so a scanner
+ * probing random paths doesn't get a path lookup on the wire thread for each.
+ */
+#define NEG_CACHE_SIZE 256
+#define NEG_TTL_SECS 10
+#define NEG_WATCH_MASK (IN_CREATE|IN_MOVED_TO|IN_ONLYDIR)
+
+/* The buffers start at a huge page boundary so that they can be backed by huge
+ * pages when requested.
+ */
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+/* A new binary that gets the cache memfd on an upgrade only attaches to it if
+ * the layout is the same, otherwise it starts with a fresh cache.
+ */
+#define CACHE_MAGIC 0x57484331
+
+/* The reference count is updated atomically as it is shared by all the worker
+ * processes. Files with the same content share a buffer, each cache item that
+ * has it attached holds a reference. The count of each owner is taken after
+ * the total and dropped before it, a crash in between may leak a reference but
+ * never gives back one that is in use.
+ */
 struct buf_item {
 	int ref_cnt;
-	char *buf;
+	int owner_refs[CACHE_OWNERS];
 };
 
+/* Everything in a cache item is shared between the worker processes and is
+ * protected by the cache lock. No pointers are kept in the shared memory as
+ * it is not mapped at the same address in all processes.
+ */
 struct cache_item {
 	unsigned refresh_counter;
+	unsigned hits;
 	char filename[255];
 	char last_modified[32];
 	struct stat stbuf;
-	struct buf_item *buf;
-	struct list_head wakeup_list;
+	uint64_t content_hash;
+	int buf_id; // Index into the buffers plus one, zero when no buffer is attached
+	int loader; // Owner slot plus one of the process loading the item, zero if none
+};
+
+struct neg_item {
+	unsigned hash;
+	unsigned expires; // CLOCK_MONOTONIC secs, zero when the slot is free
+	char filename[255];
+};
+
+struct cache_shared {
+	unsigned magic;
+	unsigned layout_size;
+	pthread_mutex_t lock;
+	unsigned refresh_counter;
+	int max_cache_items;
+	bool owners[CACHE_OWNERS];
+	struct cache_item cache[CACHE_SIZE];
+	struct neg_item neg[NEG_CACHE_SIZE];
+	struct buf_item buffers[NUM_BUFFERS];
 };
 
 struct wakeup_list {
@@ -42,23 +115,78 @@ struct wakeup_list {
 	wire_wait_t wait;
 };
 
+/* The watches are per process, the process that adds a negative entry watches
+ * its directory and removes the entry on a create for all of them.
+ */
+struct neg_watch {
+	int wd; // Zero when the slot is free
+	char dir[255];
+};
+
+struct hotset_entry {
+	unsigned hits;
+	char filename[255];
+};
+
 /* To try and get all the files in a consistent check the freshness check is
  * triggered for all files together, this will make any staleness differences
- * minimal to the time it will take to reload all files.
+ * minimal to the time it will take to reload all files. The refresh counter
+ * lives in the shared region and is advanced only by the master worker.
  */
-static unsigned refresh_counter;
-static struct cache_item cache[CACHE_SIZE];
-static struct buf_item buffers[NUM_BUFFERS];
-static int max_cache_items;
+static struct cache_shared *shared;
+static char *buffer_data;
+static int cache_memfd = -1;
+static bool cache_master;
+static int cache_owner = -1;
+static bool cache_attached;
 static wire_t refresh_wire;
 
+/* The waiters for a load can only be woken up by the process that does the
+ * load so the wakeup lists are private to each process.
+ */
+static struct list_head wakeup_lists[CACHE_SIZE];
+
+static struct hotset_entry hotset[CACHE_SIZE];
+static struct hotset_entry hotset_snapshot[CACHE_SIZE];
+static int hotset_len;
+static int hotset_next;
+static char hotset_buf[HOTSET_BUF_SIZE];
+static wire_t warmup_wires[WARMUP_WIRES];
+
+static int neg_inotify_fd = -1;
+static struct neg_watch neg_watches[NEG_CACHE_SIZE];
+static int neg_watch_next;
+static wire_t neg_watch_wire;
+
+static void cache_lock(void)
+{
+	int ret = pthread_mutex_lock(&shared->lock);
+	if (ret == EOWNERDEAD) {
+		// A worker died while holding the lock, the sections under the lock
+		// never leave the cache inconsistent so it is safe to continue
+		xlog("Cache lock owner died, recovering the lock");
+		pthread_mutex_consistent(&shared->lock);
+	}
+}
+
+static void cache_unlock(void)
+{
+	pthread_mutex_unlock(&shared->lock);
+}
+
+static char *buf_data(struct buf_item *buf)
+{
+	return buffer_data + (size_t)(buf - shared->buffers) * BUFFER_SIZE;
+}
+
 static struct buf_item *alloc_buf(void)
 {
 	int i;
 	for (i = 0; i < NUM_BUFFERS; i++) {
-		struct buf_item *buf = &buffers[i];
-		if (buf->ref_cnt == 0) {
-			buf->ref_cnt++;
+		struct buf_item *buf = &shared->buffers[i];
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&buf->ref_cnt, &unused, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			__atomic_add_fetch(&buf->owner_refs[cache_owner], 1, __ATOMIC_RELAXED);
 			return buf;
 		}
 	}
@@ -66,15 +194,35 @@ static struct buf_item *alloc_buf(void)
 	return NULL;
 }
 
+static void ref_buf(struct buf_item *buf)
+{
+	__atomic_add_fetch(&buf->ref_cnt, 1, __ATOMIC_ACQUIRE);
+	__atomic_add_fetch(&buf->owner_refs[cache_owner], 1, __ATOMIC_RELAXED);
+}
+
 static void free_buf(struct buf_item *buf)
 {
-	if (buf)
-		buf->ref_cnt--;
+	if (buf) {
+		__atomic_sub_fetch(&buf->owner_refs[cache_owner], 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&buf->ref_cnt, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static struct buf_item *item_buf(struct cache_item *item)
+{
+	if (item->buf_id == 0)
+		return NULL;
+	return &shared->buffers[item->buf_id - 1];
+}
+
+static void item_set_buf(struct cache_item *item, struct buf_item *buf)
+{
+	item->buf_id = buf ? buf - shared->buffers + 1 : 0;
 }
 
 static bool cache_item_unused(struct cache_item *item)
 {
-	return item && item->filename[0];
+	return item && !item->filename[0];
 }
 
 static void free_cache_item(struct cache_item *item)
@@ -85,15 +233,15 @@ static void free_cache_item(struct cache_item *item)
 static struct cache_item *_cache_item_alloc(void)
 {
 	int i;
-	for (i = 0; i < max_cache_items; i++) {
-		struct cache_item *item = &cache[i];
+	for (i = 0; i < shared->max_cache_items; i++) {
+		struct cache_item *item = &shared->cache[i];
 		if (cache_item_unused(item))
 			return item;
 	}
 
-	if (max_cache_items < CACHE_SIZE) {
-		struct cache_item *item = &cache[max_cache_items];
-		max_cache_items++;
+	if (shared->max_cache_items < CACHE_SIZE) {
+		struct cache_item *item = &shared->cache[shared->max_cache_items];
+		shared->max_cache_items++;
 		return item;
 	}
 
@@ -108,11 +256,23 @@ static struct cache_item *cache_item_alloc(const char *filename)
 
 	memset(item, 0, sizeof(*item));
 	strcpy(item->filename, filename);
-	list_head_init(&item->wakeup_list);
-	item->refresh_counter = refresh_counter-1;
+	item->refresh_counter = shared->refresh_counter-1;
 	return item;
 }
 
+static void cache_wakeup(struct cache_item *item)
+{
+	struct list_head *wakeup_list = &wakeup_lists[item - shared->cache];
+	struct list_head *head;
+
+	while ( (head = list_head(wakeup_list)) != NULL )
+	{
+		struct wakeup_list *wake = list_entry(head, struct wakeup_list, list);
+		wire_wait_resume(&wake->wait);
+		list_del(head);
+	}
+}
+
 static int open_file(const char *filename, struct stat *stbuf)
 {
 	int fd = wio_open(filename, O_RDONLY, 0);
@@ -148,64 +308,196 @@ static void calc_last_modified(char *str, int str_len, uint32_t mtime)
 	strftime(str, str_len, "%a, %d %b %Y %H:%M:%S %Z", tmp);
 }
 
-static bool cache_load(struct cache_item *item, struct buf_item *old_buf, off_t *file_size, int *pfd)
+static uint64_t content_hash(const char *data, off_t len)
+{
+	uint64_t hash = len;
+	off_t i;
+
+	// A word at a time, the matches are compared in full anyway
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+		hash ^= hash >> 32;
+	}
+	for (; i < len; i++)
+		hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ull;
+
+	return hash;
+}
+
+/* Find another cached file with the same content and take a reference to its
+ * buffer. A buffer attached to an item is never written to, so it can be
+ * compared without the lock once we hold a reference.
+ */
+static struct buf_item *cache_dedup(struct cache_item *item, const char *data, uint64_t hash, off_t size)
+{
+	struct buf_item *dup = NULL;
+	int i;
+
+	cache_lock();
+	for (i = 0; i < shared->max_cache_items; i++) {
+		struct cache_item *other = &shared->cache[i];
+		struct buf_item *buf = item_buf(other);
+		if (other != item && buf && other->content_hash == hash && other->stbuf.st_size == size) {
+			ref_buf(buf);
+			dup = buf;
+			break;
+		}
+	}
+	cache_unlock();
+
+	if (dup && memcmp(buf_data(dup), data, size) != 0) {
+		// Hash collision
+		free_buf(dup);
+		return NULL;
+	}
+
+	return dup;
+}
+
+/* Without a free buffer the file can still share the buffer of a cached file
+ * with the same content, the file is compared with it a chunk at a time. On a
+ * match the buffer is returned with a reference taken along with its hash.
+ */
+static struct buf_item *cache_dedup_file(struct cache_item *item, int fd, off_t size, uint64_t *hash)
+{
+	bool compared[NUM_BUFFERS] = {};
+	char chunk[DEDUP_CHUNK_SIZE];
+	int next = 0;
+
+	while (1) {
+		struct buf_item *dup = NULL;
+
+		cache_lock();
+		for (; next < shared->max_cache_items && !dup; next++) {
+			struct cache_item *other = &shared->cache[next];
+			struct buf_item *buf = item_buf(other);
+			if (other != item && buf && other->stbuf.st_size == size && !compared[other->buf_id - 1]) {
+				compared[other->buf_id - 1] = true;
+				ref_buf(buf);
+				dup = buf;
+				*hash = other->content_hash;
+			}
+		}
+		cache_unlock();
+
+		if (!dup)
+			return NULL;
+
+		off_t offset;
+		for (offset = 0; offset < size; offset += DEDUP_CHUNK_SIZE) {
+			int len = size - offset < DEDUP_CHUNK_SIZE ? size - offset : DEDUP_CHUNK_SIZE;
+			if (wio_pread(fd, chunk, len, offset) != len || memcmp(buf_data(dup) + offset, chunk, len) != 0)
+				break;
+		}
+		if (offset >= size)
+			return dup;
+
+		free_buf(dup);
+	}
+}
+
+/* The same content may already be cached under another name, then its buffer
+ * is shared and the one just read is given back.
+ */
+static struct buf_item *cache_share(struct cache_item *item, struct buf_item *buf, off_t size, uint64_t *hash)
+{
+	*hash = content_hash(buf_data(buf), size);
+
+	struct buf_item *dup = cache_dedup(item, buf_data(buf), *hash, size);
+	if (!dup)
+		return buf;
+
+	DEBUG("File %s has the same content as another cached file, sharing its buffer", item->filename);
+	free_buf(buf);
+	return dup;
+}
+
+static void cache_item_loaded(struct cache_item *item, struct stat *stbuf, uint64_t hash)
+{
+	DEBUG("File successfully loaded %s", item->filename);
+	item->content_hash = hash;
+	item->stbuf = *stbuf;
+	calc_last_modified(item->last_modified, sizeof(item->last_modified), item->stbuf.st_mtime);
+}
+
+/* Called without the cache lock, the item is marked as being loaded by us so
+ * no one else will touch it until we are done. Returns the buffer to attach
+ * to the item or NULL if the file cannot be cached, in which case the fd is
+ * left open for the caller to send the file directly.
+ */
+static struct buf_item *cache_load(struct cache_item *item, struct buf_item *old_buf, off_t *file_size, int *pfd)
 {
 	struct stat stbuf;
 	int fd = open_file(item->filename, &stbuf);
 
 	*pfd = fd;
 
-	if (fd < 0)
-		return false;
+	if (fd < 0) {
+		free_buf(old_buf);
+		return NULL;
+	}
 
 	*file_size = stbuf.st_size;
 
 	if (stbuf.st_size > BUFFER_SIZE) {
 		DEBUG("File %s too large (%u)", item->filename, stbuf.st_size);
-		return false;
+		free_buf(old_buf);
+		return NULL;
 	}
 
 	// The file wasn't changed, don't waste time loading the new content
 	if (old_buf && stbuf_eq(&stbuf, &item->stbuf)) {
 		DEBUG("No need to reload data, nothing changed in file %s", item->filename);
-		item->buf = old_buf;
-		return true;
+		return old_buf;
 	}
 
 	// Insert into cache
-	item->stbuf = stbuf;
 	struct buf_item *buf;
-	if (old_buf && old_buf->ref_cnt == 1) {
-		// Reuse old buf
+	if (old_buf && __atomic_load_n(&old_buf->ref_cnt, __ATOMIC_ACQUIRE) == 1) {
+		// Reuse old buf, it is detached from the item so no one can take a new reference to it
 		DEBUG("Reuse old buf as it is not being served currently");
 		buf = old_buf;
 	} else {
 		DEBUG("New buf allocated in place of old one");
 		free_buf(old_buf);
 		buf = alloc_buf();
+		if (!buf) {
+			uint64_t hash;
+			buf = cache_dedup_file(item, fd, stbuf.st_size, &hash);
+			if (!buf) {
+				xlog("No free cache buffer to load file %s", item->filename);
+				return NULL;
+			}
+
+			DEBUG("No free cache buffer but file %s has the same content as another cached file", item->filename);
+			cache_item_loaded(item, &stbuf, hash);
+			return buf;
+		}
 	}
-	int ret = wio_pread(fd, buf->buf, stbuf.st_size, 0);
+	int ret = wio_pread(fd, buf_data(buf), stbuf.st_size, 0);
 
 	if (ret < stbuf.st_size) {
 		xlog("Failed to read file %s, expected to read %u got %d: %m", item->filename, stbuf.st_size, ret);
 		free_buf(buf);
-		return false;
+		return NULL;
 	}
 
+	uint64_t hash;
+	buf = cache_share(item, buf, stbuf.st_size, &hash);
+
 	// Load succeeded, give the buffer
-	DEBUG("File successfully loaded %s", item->filename);
-	item->refresh_counter = refresh_counter;
-	item->buf = buf;
-	calc_last_modified(item->last_modified, sizeof(item->last_modified), item->stbuf.st_mtime);
-	return true;
+	cache_item_loaded(item, &stbuf, hash);
+	return buf;
 }
 
 static struct cache_item *cache_find(const char *filename)
 {
 	int i;
 	// TODO: Improve this O(n) algorithm
-	for (i = 0; i < max_cache_items; i++) {
-		struct cache_item *item = &cache[i];
+	for (i = 0; i < shared->max_cache_items; i++) {
+		struct cache_item *item = &shared->cache[i];
 		if (strcmp(filename, item->filename) == 0) {
 			return item;
 		}
@@ -214,81 +506,526 @@ static struct cache_item *cache_find(const char *filename)
 	return NULL;
 }
 
-const char *cache_get(const char *filename, off_t *file_size, char *last_modified, int *pfd, void **data)
+static unsigned neg_hash(const char *filename)
+{
+	// FNV-1a
+	unsigned hash = 2166136261u;
+	for (; *filename; filename++)
+		hash = (hash ^ (unsigned char)*filename) * 16777619;
+	return hash;
+}
+
+static unsigned neg_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+// Must be called with the cache lock held
+static struct neg_item *neg_find(const char *filename, unsigned hash)
+{
+	unsigned now = neg_now();
+	int i;
+
+	for (i = 0; i < NEG_CACHE_SIZE; i++) {
+		struct neg_item *neg = &shared->neg[i];
+		if (neg->hash == hash && neg->expires > now && strcmp(neg->filename, filename) == 0)
+			return neg;
+	}
+
+	return NULL;
+}
+
+// Must be called with the cache lock held
+static void neg_add(const char *filename)
+{
+	unsigned hash = neg_hash(filename);
+	struct neg_item *neg = neg_find(filename, hash);
+	unsigned now = neg_now();
+	int i;
+
+	if (!neg) {
+		// Take a free or expired slot, or else the one closest to expiring
+		neg = &shared->neg[0];
+		for (i = 1; i < NEG_CACHE_SIZE && neg->expires > now; i++) {
+			if (shared->neg[i].expires < neg->expires)
+				neg = &shared->neg[i];
+		}
+	}
+
+	neg->hash = hash;
+	neg->expires = now + NEG_TTL_SECS;
+	strcpy(neg->filename, filename);
+}
+
+// Must be called with the cache lock held
+static void neg_remove(const char *filename)
+{
+	struct neg_item *neg = neg_find(filename, neg_hash(filename));
+	if (neg)
+		memset(neg, 0, sizeof(*neg));
+}
+
+static void neg_dirname(const char *filename, char *dir, int dir_len)
+{
+	const char *slash = strrchr(filename, '/');
+	if (!slash)
+		snprintf(dir, dir_len, ".");
+	else
+		snprintf(dir, dir_len, "%.*s", (int)(slash - filename), filename);
+}
+
+// Must be called with the cache lock held
+static bool neg_dir_cached(const char *dir)
+{
+	size_t dir_len = strlen(dir);
+	int i;
+
+	for (i = 0; i < shared->max_cache_items; i++) {
+		struct cache_item *item = &shared->cache[i];
+		if (!item->buf_id)
+			continue;
+
+		const char *slash = strrchr(item->filename, '/');
+		if (!slash) {
+			if (strcmp(dir, ".") == 0)
+				return true;
+		} else if ((size_t)(slash - item->filename) == dir_len && memcmp(item->filename, dir, dir_len) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Watch the directory of a missing file for it to be created, otherwise the
+ * entry only expires by its TTL.
+ */
+static void neg_watch(const char *filename)
+{
+	char dir[255];
+	int i;
+
+	if (neg_inotify_fd < 0)
+		return;
+
+	neg_dirname(filename, dir, sizeof(dir));
+	for (i = 0; i < NEG_CACHE_SIZE; i++) {
+		if (neg_watches[i].wd && strcmp(neg_watches[i].dir, dir) == 0)
+			return;
+	}
+
+	cache_lock();
+	bool cached = neg_dir_cached(dir);
+	cache_unlock();
+	if (!cached)
+		return;
+
+	int wd = inotify_add_watch(neg_inotify_fd, dir, NEG_WATCH_MASK);
+	if (wd < 0)
+		return;
+
+	// Recycle the oldest watch when there are too many
+	struct neg_watch *watch = &neg_watches[neg_watch_next++ % NEG_CACHE_SIZE];
+	if (watch->wd && watch->wd != wd)
+		inotify_rm_watch(neg_inotify_fd, watch->wd);
+	watch->wd = wd;
+	strcpy(watch->dir, dir);
+}
+
+static void neg_flush(void)
+{
+	cache_lock();
+	memset(shared->neg, 0, sizeof(shared->neg));
+	cache_unlock();
+}
+
+static void neg_watch_event(struct inotify_event *event)
+{
+	struct neg_watch *watch = NULL;
+	char filename[255];
+	int i;
+
+	if (event->mask & IN_Q_OVERFLOW) {
+		// Events were lost, any of the missing files may have been created
+		neg_flush();
+		return;
+	}
+
+	for (i = 0; i < NEG_CACHE_SIZE; i++) {
+		if (neg_watches[i].wd == event->wd) {
+			watch = &neg_watches[i];
+			break;
+		}
+	}
+	if (!watch)
+		return;
+
+	if (event->mask & IN_IGNORED) {
+		// The directory is gone or the watch was recycled
+		watch->wd = 0;
+		return;
+	}
+
+	if (!event->len)
+		return;
+
+	int len;
+	if (strcmp(watch->dir, ".") == 0)
+		len = snprintf(filename, sizeof(filename), "%s", event->name);
+	else
+		len = snprintf(filename, sizeof(filename), "%s/%s", watch->dir, event->name);
+	// A name that long can't be in the negative cache
+	if (len >= (int)sizeof(filename))
+		return;
+
+	DEBUG("File %s created, dropping it from the negative cache", filename);
+	cache_lock();
+	neg_remove(filename);
+	cache_unlock();
+}
+
+static void neg_watch_run(void *arg)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	(void)arg;
+
+	wire_fd_state_t fd_state;
+	wire_fd_mode_init(&fd_state, neg_inotify_fd);
+	wire_fd_mode_read(&fd_state);
+
+	while (1) {
+		int ret = read(neg_inotify_fd, buf, sizeof(buf));
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				wire_fd_wait(&fd_state);
+				wire_wait_reset(&fd_state.wait);
+				continue;
+			}
+			xlog("Error reading file create events: %m");
+			break;
+		}
+
+		char *ptr = buf;
+		while (ptr < buf + ret) {
+			struct inotify_event *event = (struct inotify_event *)ptr;
+			neg_watch_event(event);
+			ptr += sizeof(*event) + event->len;
+		}
+	}
+
+	wire_fd_mode_none(&fd_state);
+	close(neg_inotify_fd);
+	neg_inotify_fd = -1;
+}
+
+static void cache_not_found(const char *filename)
+{
+	cache_lock();
+	neg_add(filename);
+	cache_unlock();
+	neg_watch(filename);
+}
+
+static const char *cache_open_direct(const char *filename, off_t *file_size, char *last_modified, int *pfd)
+{
+	struct stat stbuf;
+	*pfd = open_file(filename, &stbuf);
+	if (*pfd >= 0) {
+		*file_size = stbuf.st_size;
+		calc_last_modified(last_modified, 32, stbuf.st_mtime);
+	} else if (*pfd == -2) {
+		cache_not_found(filename);
+	}
+	return NULL;
+}
+
+// Must be called with the cache lock held
+static const char *cache_hit(struct cache_item *item, off_t *file_size, char *last_modified, void **data)
+{
+	struct buf_item *buf = item_buf(item);
+
+	*file_size = item->stbuf.st_size;
+	strcpy(last_modified, item->last_modified);
+	*data = buf;
+	ref_buf(buf);
+	return buf_data(buf);
+}
+
+static const char *_cache_get(const char *filename, off_t *file_size, char *last_modified, int *pfd, void **data, unsigned hits)
 {
+	const char *ret;
+
+	*pfd = -1;
+
+	// Without an owner slot nothing it takes could be reclaimed
+	if (cache_owner < 0)
+		return cache_open_direct(filename, file_size, last_modified, pfd);
+
+	cache_lock();
 	struct cache_item *item = cache_find(filename);
-	if (!item)
+	if (!item) {
+		if (neg_find(filename, neg_hash(filename))) {
+			// Known to be missing
+			cache_unlock();
+			*pfd = -2;
+			return NULL;
+		}
 		item = cache_item_alloc(filename);
+	}
 
 	if (!item) {
 		// No place in cache for this file
-		struct stat stbuf;
-		*pfd = open_file(filename, &stbuf);
-		if (*pfd >= 0) {
-			*file_size = stbuf.st_size;
-			calc_last_modified(last_modified, 32, stbuf.st_mtime);
-		}
-		return NULL;
+		cache_unlock();
+		return cache_open_direct(filename, file_size, last_modified, pfd);
 	}
 
-	if (item->refresh_counter != refresh_counter) {
+	item->hits += hits;
+
+	if (!item->loader && item->refresh_counter != shared->refresh_counter) {
 		// Need to refresh the buffer, everyone else should wait as well
 		xlog("Trying to reload file %s", filename);
-		struct buf_item *old_buf = item->buf;
-		item->buf = NULL;
-		item->refresh_counter = refresh_counter;
+		struct buf_item *old_buf = item_buf(item);
+		item_set_buf(item, NULL);
+		item->refresh_counter = shared->refresh_counter;
+		item->loader = cache_owner + 1;
+		cache_unlock();
 
 		// Refresh content
-		bool loaded = cache_load(item, old_buf, file_size, pfd);
+		struct buf_item *buf = cache_load(item, old_buf, file_size, pfd);
+
+		cache_lock();
+		item->loader = 0;
+		if (buf) {
+			item_set_buf(item, buf);
+			ret = cache_hit(item, file_size, last_modified, data);
+		} else {
+			free_cache_item(item);
+			ret = NULL;
+		}
+		cache_unlock();
 
 		// Wakeup the waiters
-		struct list_head *head;
-		while ( (head = list_head(&item->wakeup_list)) != NULL )
-		{
-			struct wakeup_list *wake = list_entry(head, struct wakeup_list, list);
-			wire_wait_resume(&wake->wait);
-			list_del(head);
-		}
+		cache_wakeup(item);
 
-		if (!loaded) {
-			free_cache_item(item);
-			return NULL;
-		}
+		if (*pfd == -2)
+			cache_not_found(filename);
 
 		// Cache was loaded, close the fd
-		if (*pfd >= 0) {
+		if (ret && *pfd >= 0) {
 			wio_close(*pfd);
 			*pfd = -1;
 		}
 
-		assert(item->buf);
+		return ret;
 	}
 
-	if (item->buf == NULL) {
-		// Cache item is still loading, need to wait
-		struct wakeup_list wakeup;
-		wire_wait_init(&wakeup.wait);
-		list_add_tail(&wakeup.list, &item->wakeup_list);
-		wire_wait_single(&wakeup.wait);
-		if (item->buf == NULL) {
-			*pfd = -1;
-			// Load failed, tell the caller to load it itself and report the error
-			return NULL;
+	if (item_buf(item) == NULL) {
+		if (item->loader == cache_owner + 1) {
+			// Cache item is still loading, need to wait
+			struct wakeup_list wakeup;
+			wire_wait_init(&wakeup.wait);
+			list_add_tail(&wakeup.list, &wakeup_lists[item - shared->cache]);
+			cache_unlock();
+			wire_wait_single(&wakeup.wait);
+			cache_lock();
+		}
+
+		if (item_buf(item) == NULL || strcmp(item->filename, filename) != 0) {
+			// Load failed or it is done by another worker process, load it ourselves
+			cache_unlock();
+			return cache_open_direct(filename, file_size, last_modified, pfd);
 		}
 	}
 
 	// Cache hit
-	*file_size = item->stbuf.st_size;
-	strcpy(last_modified, item->last_modified);
-	*data = item->buf;
-	item->buf->ref_cnt++;
-	return item->buf->buf;
+	ret = cache_hit(item, file_size, last_modified, data);
+	cache_unlock();
+	return ret;
+}
+
+const char *cache_get(const char *filename, off_t *file_size, char *last_modified, int *pfd, void **data)
+{
+	return _cache_get(filename, file_size, last_modified, pfd, data, 1);
 }
 
 void cache_release(void *data)
 {
-	struct buf_item *buf = data;
-	buf->ref_cnt--;
+	free_buf(data);
+}
+
+static int hotset_cmp(const void *a, const void *b)
+{
+	const struct hotset_entry *item_a = a;
+	const struct hotset_entry *item_b = b;
+
+	if (item_a->hits > item_b->hits)
+		return -1;
+	if (item_a->hits < item_b->hits)
+		return 1;
+	return 0;
+}
+
+/* Write the cached files ordered by their hit count, the file is written to a
+ * temporary name and renamed into place so a crash in the middle will not
+ * leave a partial hot-set behind.
+ */
+static void cache_hotset_save(void)
+{
+	int num_items = 0;
+	int i;
+
+	cache_lock();
+	for (i = 0; i < shared->max_cache_items; i++) {
+		struct cache_item *item = &shared->cache[i];
+		if (!cache_item_unused(item) && item->buf_id && item->hits > 0) {
+			hotset_snapshot[num_items].hits = item->hits;
+			strcpy(hotset_snapshot[num_items].filename, item->filename);
+			num_items++;
+		}
+	}
+	cache_unlock();
+
+	qsort(hotset_snapshot, num_items, sizeof(hotset_snapshot[0]), hotset_cmp);
+
+	int len = 0;
+	for (i = 0; i < num_items; i++) {
+		int ret = snprintf(hotset_buf + len, sizeof(hotset_buf) - len, "%u %s\n", hotset_snapshot[i].hits, hotset_snapshot[i].filename);
+		if (ret < 0 || ret >= (int)sizeof(hotset_buf) - len)
+			break;
+		len += ret;
+	}
+
+	char tmp_name[512];
+	int fd = state_create(HOTSET_FILE, tmp_name, sizeof(tmp_name));
+	if (fd < 0) {
+		xlog("Failed to open the hot-set file for writing: %m");
+		return;
+	}
+
+	int ret = wio_pwrite(fd, hotset_buf, len, 0);
+	wio_close(fd);
+	if (ret != len) {
+		xlog("Failed to write hot-set file, expected to write %d got %d: %m", len, ret);
+		unlink(tmp_name);
+		return;
+	}
+
+	if (!state_commit(tmp_name, HOTSET_FILE))
+		return;
+
+	DEBUG("Saved %d entries to the hot-set", num_items);
+}
+
+/* Age the hit counts so the hot-set follows the recent traffic and not the
+ * files that were popular a long time ago.
+ */
+static void cache_hotset_decay(void)
+{
+	int i;
+
+	cache_lock();
+	for (i = 0; i < shared->max_cache_items; i++)
+		shared->cache[i].hits /= 2;
+	cache_unlock();
+}
+
+/* Every file sharing the buffer of another one saves a whole buffer, the size
+ * of their content is reported as well to show how much of that is used.
+ */
+static void cache_dedup_report(void)
+{
+	bool seen[NUM_BUFFERS] = {};
+	unsigned long long dedup_bytes = 0;
+	int num_files = 0;
+	int dedup_files = 0;
+	int i;
+
+	cache_lock();
+	for (i = 0; i < shared->max_cache_items; i++) {
+		struct cache_item *item = &shared->cache[i];
+		if (!item->buf_id)
+			continue;
+
+		num_files++;
+		if (seen[item->buf_id - 1]) {
+			dedup_files++;
+			dedup_bytes += item->stbuf.st_size;
+		}
+		seen[item->buf_id - 1] = true;
+	}
+	cache_unlock();
+
+	xlog("Cache holds %d files, %d share the content of another file, saving %d buffers of %d bytes for %llu bytes of content",
+			num_files, dedup_files, dedup_files, BUFFER_SIZE, dedup_bytes);
+}
+
+/* Called at startup before any request is served, so it is fine to block on
+ * the read here.
+ */
+static void cache_hotset_load(void)
+{
+	char path[512];
+	if (!state_path(path, sizeof(path), HOTSET_FILE))
+		return;
+
+	int fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd < 0) {
+		DEBUG("No hot-set to load: %m");
+		return;
+	}
+
+	int len = read(fd, hotset_buf, sizeof(hotset_buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	hotset_buf[len] = 0;
+
+	char *line = hotset_buf;
+	while (*line && hotset_len < CACHE_SIZE) {
+		char *end = strchr(line, '\n');
+		if (!end)
+			break; // Partial line, the file was truncated
+		*end = 0;
+
+		char *filename;
+		unsigned long hits = strtoul(line, &filename, 10);
+		if (*filename == ' ' && filename[1] && strlen(filename+1) < sizeof(hotset[0].filename)) {
+			struct hotset_entry *entry = &hotset[hotset_len++];
+			entry->hits = hits;
+			strcpy(entry->filename, filename+1);
+		}
+
+		line = end + 1;
+	}
+
+	xlog("Loaded %d entries from the hot-set", hotset_len);
+}
+
+/* Several warm-up wires pull entries from the hot-set so that the loads run
+ * in parallel on the io threads, the hottest files are taken first.
+ */
+static void cache_warmup(void *arg)
+{
+	(void)arg;
+
+	while (hotset_next < hotset_len) {
+		struct hotset_entry *entry = &hotset[hotset_next++];
+		off_t file_size;
+		char last_modified[32];
+		void *data;
+		int fd = -1;
+
+		const char *buf = _cache_get(entry->filename, &file_size, last_modified, &fd, &data, entry->hits);
+		if (buf) {
+			cache_release(data);
+		} else if (fd >= 0) {
+			// No room left in the cache or the file is too large now
+			wio_close(fd);
+		}
+	}
 }
 
 static int timer_setup(void)
@@ -313,17 +1050,28 @@ static int timer_setup(void)
 	return fd;
 }
 
-static int signal_setup(void)
+static void signal_set(sigset_t *sig_set)
+{
+	sigemptyset(sig_set);
+	sigaddset(sig_set, SIGUSR1);
+}
+
+static void signal_block(void)
 {
 	sigset_t sig_set;
 
-	sigemptyset(&sig_set);
-	sigaddset(&sig_set, SIGUSR1);
-	sigaddset(&sig_set, SIGUSR2);
+	signal_set(&sig_set);
 
 	int ret = pthread_sigmask(SIG_BLOCK, &sig_set, NULL);
 	if (ret < 0)
 		xlog("Failed to block signals: %m");
+}
+
+static int signal_setup(void)
+{
+	sigset_t sig_set;
+
+	signal_set(&sig_set);
 
 	int fd = signalfd(-1, &sig_set, SFD_NONBLOCK|SFD_CLOEXEC);
 	if (fd < 0)
@@ -336,16 +1084,20 @@ static void cache_refresh_timer(void *arg)
 {
 	(void)arg;
 
-	int tfd = timer_setup();
+	// Only the master worker advances the refresh counter, the others only
+	// pass along the refresh signals
+	int tfd = cache_master ? timer_setup() : -1;
 	int sfd = signal_setup();
-	if (tfd < 0 || sfd < 0) {
+	if ((cache_master && tfd < 0) || sfd < 0) {
 		xlog("Failed to start the cache refresh timer");
 		return;
 	}
 
 	wire_fd_state_t tfd_state;
-	wire_fd_mode_init(&tfd_state, tfd);
-	wire_fd_mode_read(&tfd_state);
+	if (cache_master) {
+		wire_fd_mode_init(&tfd_state, tfd);
+		wire_fd_mode_read(&tfd_state);
+	}
 
 	wire_fd_state_t sfd_state;
 	wire_fd_mode_init(&sfd_state, sfd);
@@ -353,13 +1105,16 @@ static void cache_refresh_timer(void *arg)
 
 	wire_wait_list_t wait_list;
 	wire_wait_list_init(&wait_list);
-	wire_fd_wait_list_chain(&wait_list, &tfd_state);
+	if (cache_master)
+		wire_fd_wait_list_chain(&wait_list, &tfd_state);
 	wire_fd_wait_list_chain(&wait_list, &sfd_state);
 
+	unsigned save_ticks = 0;
+
 	while (1) {
 		wire_list_wait(&wait_list);
 
-		if (tfd_state.wait.triggered) {
+		if (cache_master && tfd_state.wait.triggered) {
 			wire_wait_reset(&tfd_state.wait);
 
 			uint64_t timer_val = 0;
@@ -370,7 +1125,14 @@ static void cache_refresh_timer(void *arg)
 					break;
 				}
 			} else {
-				refresh_counter++;
+				__atomic_add_fetch(&shared->refresh_counter, 1, __ATOMIC_RELAXED);
+
+				if (++save_ticks == HOTSET_SAVE_TICKS) {
+					save_ticks = 0;
+					cache_hotset_save();
+					cache_hotset_decay();
+					cache_dedup_report();
+				}
 			}
 		}
 
@@ -386,27 +1148,248 @@ static void cache_refresh_timer(void *arg)
 				}
 			} else {
 				xlog("Refresh counter increased by signal");
-				refresh_counter++;
+				__atomic_add_fetch(&shared->refresh_counter, 1, __ATOMIC_RELAXED);
+				neg_flush();
 			}
 		}
 	}
 
-	wire_fd_mode_none(&tfd_state);
-	wio_close(tfd);
+	if (cache_master) {
+		wire_fd_mode_none(&tfd_state);
+		wio_close(tfd);
+	}
 
 	wire_fd_mode_none(&sfd_state);
 	wio_close(sfd);
 	xlog("Cache refresh timer exited");
 }
 
-void cache_init(void)
+static void *cache_map(size_t size, bool huge_pages)
 {
+	int flags = MFD_CLOEXEC;
+#ifdef MFD_HUGETLB
+	if (huge_pages)
+		flags |= MFD_HUGETLB;
+#else
+	if (huge_pages)
+		return MAP_FAILED;
+#endif
+
+	int fd = memfd_create("wire-httpd cache", flags);
+	if (fd < 0) {
+		xlog("Failed to create the cache memfd: %m");
+		if (huge_pages)
+			return MAP_FAILED;
+		// A shared anonymous mapping is still shared with the forked workers
+		return mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		xlog("Failed to size the cache memfd: %m");
+		close(fd);
+		return MAP_FAILED;
+	}
+
+	// Huge pages are reserved at mmap time so a lack of them is detected here
+	void *region = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (region == MAP_FAILED) {
+		close(fd);
+		return region;
+	}
+
+	// Kept open to be handed over to a new binary on upgrade
+	cache_memfd = fd;
+	return region;
+}
+
+static size_t cache_header_size(void)
+{
+	return (sizeof(struct cache_shared) + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+}
+
+static size_t cache_region_size(void)
+{
+	return cache_header_size() + (size_t)NUM_BUFFERS * BUFFER_SIZE;
+}
+
+/* Attach to the cache of the server we are upgrading from, the cache index and
+ * lock are used as is so the hot content is served right away.
+ */
+static bool cache_attach(int fd)
+{
+	struct stat stbuf;
+	if (fstat(fd, &stbuf) < 0 || (size_t)stbuf.st_size != cache_region_size()) {
+		xlog("Cache received on upgrade has a different size, not using it");
+		return false;
+	}
+
+	char *region = mmap(NULL, stbuf.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (region == MAP_FAILED) {
+		xlog("Failed to map the cache received on upgrade: %m");
+		return false;
+	}
+
+	struct cache_shared *attach = (struct cache_shared *)region;
+	if (attach->magic != CACHE_MAGIC || attach->layout_size != sizeof(struct cache_shared)) {
+		xlog("Cache received on upgrade has a different layout, not using it");
+		munmap(region, stbuf.st_size);
+		return false;
+	}
+
+	shared = attach;
+	buffer_data = region + cache_header_size();
+	cache_memfd = fd;
+	cache_attached = true;
+	xlog("Attached to the cache of the previous server");
+	return true;
+}
+
+/* Must be called before any other thread is started so that the signals we
+ * handle through the signalfd are blocked in all of them. It is also called
+ * before the worker processes are forked so they all share the same cache.
+ *
+ * The handoff_fd is the cache memfd received on upgrade or -1.
+ */
+void cache_init(bool huge_pages, int handoff_fd)
+{
+	signal_block();
+
+	if (handoff_fd >= 0) {
+		if (cache_attach(handoff_fd))
+			return;
+		close(handoff_fd);
+	}
+
+	size_t header_size = cache_header_size();
+	size_t size = cache_region_size();
+
+	char *region = MAP_FAILED;
+	if (huge_pages) {
+		region = cache_map(size, true);
+		if (region == MAP_FAILED)
+			xlog("Failed to map the cache with huge pages, falling back to transparent huge pages: %m");
+	}
+	if (region == MAP_FAILED) {
+		region = cache_map(size, false);
+		if (region == MAP_FAILED) {
+			xlog("Failed to map the cache: %m");
+			exit(1);
+		}
+		if (huge_pages)
+			madvise(region, size, MADV_HUGEPAGE);
+	}
+
+	shared = (struct cache_shared *)region;
+	buffer_data = region + header_size;
+	shared->magic = CACHE_MAGIC;
+	shared->layout_size = sizeof(struct cache_shared);
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shared->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/* Called in each worker process, the master worker is the one to advance the
+ * refresh counter, save the hot-set and warm up the cache.
+ */
+void cache_start(bool master)
+{
+	int i;
+
+	cache_master = master;
+
+	for (i = 0; i < CACHE_SIZE; i++)
+		list_head_init(&wakeup_lists[i]);
+
+	wire_init(&refresh_wire, "cache refresh timer", cache_refresh_timer, NULL, WIRE_STACK_ALLOC(8192));
+
+	// Without inotify the negative entries only expire by their TTL
+	neg_inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (neg_inotify_fd >= 0)
+		wire_init(&neg_watch_wire, "cache negative watch", neg_watch_run, NULL, WIRE_STACK_ALLOC(8192));
+	else
+		xlog("Failed to watch for file creation, missing files are only cached for %d secs: %m", NEG_TTL_SECS);
+
+	// An attached cache is already warm
+	if (!master || cache_attached)
+		return;
+
+	cache_hotset_load();
+	for (i = 0; i < WARMUP_WIRES && i < hotset_len; i++)
+		wire_init(&warmup_wires[i], "cache warmup", cache_warmup, NULL, WIRE_STACK_ALLOC(16384));
+}
+
+/* Takes an owner slot for the process about to use the cache, the supervisor
+ * takes one for each worker before forking it.
+ */
+int cache_owner_alloc(void)
+{
+	int i;
+
+	cache_owner = -1;
+	cache_lock();
+	for (i = 0; i < CACHE_OWNERS; i++) {
+		if (!shared->owners[i]) {
+			shared->owners[i] = true;
+			cache_owner = i;
+			break;
+		}
+	}
+	cache_unlock();
+
+	if (cache_owner < 0)
+		xlog("No cache owner slot left, the worker will serve without the cache");
+	return cache_owner;
+}
+
+/* Called by the supervisor once a worker is gone, whether it crashed or was
+ * killed while draining. The references it held are dropped and the files it
+ * was loading are loaded again by the next request for them.
+ */
+void cache_owner_reclaim(int owner)
+{
+	int refs = 0;
+	int loads = 0;
 	int i;
 
+	if (owner < 0)
+		return;
+
+	cache_lock();
 	for (i = 0; i < NUM_BUFFERS; i++) {
-		struct buf_item *buf = &buffers[i];
-		buf->buf = mmap(NULL, BUFFER_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		struct buf_item *buf = &shared->buffers[i];
+		int n = __atomic_exchange_n(&buf->owner_refs[owner], 0, __ATOMIC_ACQ_REL);
+		if (n) {
+			__atomic_sub_fetch(&buf->ref_cnt, n, __ATOMIC_RELEASE);
+			refs += n;
+		}
+	}
+
+	for (i = 0; i < shared->max_cache_items; i++) {
+		struct cache_item *item = &shared->cache[i];
+		if (item->loader == owner + 1) {
+			item->loader = 0;
+			item->refresh_counter = shared->refresh_counter-1;
+			loads++;
+		}
 	}
+	shared->owners[owner] = false;
+	cache_unlock();
 
-	wire_init(&refresh_wire, "cache refresh timer", cache_refresh_timer, NULL, WIRE_STACK_ALLOC(4096));
+	if (refs || loads)
+		xlog("Reclaimed %d buffer references and %d unfinished loads of a dead worker", refs, loads);
+}
+
+int cache_fd(void)
+{
+	return cache_memfd;
+}
+
+void cache_shutdown(void)
+{
+	if (cache_master)
+		cache_hotset_save();
 }
@@ -1,6 +1,12 @@
 #include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
 
-void cache_init(void);
+void cache_init(bool huge_pages, int handoff_fd);
+void cache_start(bool master);
+void cache_shutdown(void);
+int cache_fd(void);
+int cache_owner_alloc(void);
+void cache_owner_reclaim(int owner);
 const char *cache_get(const char *filename, off_t *file_size, char *last_modified, int *fd, void **data);
 void cache_release(void *data);
@@ -0,0 +1,462 @@
+#include "conn.h"
+#include "timer.h"
+#include "tls.h"
+#include "xlog.h"
+
+#include "wire.h"
+#include "wire_stack.h"
+
+#include "libwire/test/utils.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* A window starts when a client first blocks a write, a client that is still
+ * blocked at its end and read less than MIN_SEND_RATE bytes per second over it
+ * (or nothing at all) is dropped. The blocked writers are checked against the
+ * end of their window every SEND_DEADLINE_CHECK_MSECS.
+ */
+#define SEND_RATE_WINDOW_MSECS 10*1000
+#define SEND_DEADLINE_CHECK_MSECS 1000
+#define MIN_SEND_RATE 1024
+
+// Keep little unsent data in the kernel, it is only waiting for the client
+#define NOTSENT_LOWAT 128*1024
+
+/* All the connections share the wire thread, a response yields to the others
+ * every SEND_QUANTUM bytes it writes so that a long transfer to a fast client
+ * doesn't hold back the small responses. It is also the burst a rate limited
+ * connection may send at once.
+ */
+#define SEND_QUANTUM 128*1024
+
+static int blocked_writers;
+static struct list_head blocked_conns;
+static struct list_head idle_conns;
+static wire_t deadline_wire;
+static unsigned send_rate_limit;
+static bool shaping_stopped;
+
+static unsigned now_msecs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void conn_init(struct conn *conn, int fd)
+{
+	conn->fd = fd;
+	conn->ssl = NULL;
+	conn->ktls_send = false;
+	conn->want_write = false;
+	conn->write_timeout = false;
+	conn->send_deadline = 0;
+	conn->window_start = 0;
+	conn->window_bytes = 0;
+	conn->quantum_bytes = 0;
+	conn->rate_limit = send_rate_limit;
+	conn->shape_deferred = false;
+	conn->shape_tokens = SEND_QUANTUM;
+	conn->shape_msecs = send_rate_limit ? now_msecs() : 0;
+
+	int lowat = NOTSENT_LOWAT;
+	setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+
+	wire_fd_mode_init(&conn->fd_state, fd);
+	memset(&conn->trace, 0, sizeof(conn->trace));
+
+	set_nonblock(fd);
+}
+
+bool conn_tls_handshake(struct conn *conn, int timeout_msecs)
+{
+	wire_timer_t timer;
+	bool done = false;
+
+	conn->ssl = tls_new(conn->fd);
+	if (!conn->ssl)
+		return false;
+
+	if (!timer_start(&timer, timeout_msecs))
+		return false;
+
+	while (1) {
+		enum tls_status status = tls_handshake(conn->ssl);
+		if (status == TLS_DONE) {
+			done = true;
+			break;
+		} else if (status == TLS_ERROR) {
+			DEBUG("TLS handshake failed on socket %d", conn->fd);
+			break;
+		}
+
+		if (status == TLS_WANT_WRITE)
+			wire_fd_mode_write(&conn->fd_state);
+		else
+			wire_fd_mode_read(&conn->fd_state);
+
+		wire_wait_list_t wait_list;
+		wire_wait_list_init(&wait_list);
+		wire_fd_wait_list_chain(&wait_list, &conn->fd_state);
+		timer_list_chain(&timer, &wait_list);
+		wire_list_wait(&wait_list);
+		wire_fd_mode_none(&conn->fd_state);
+
+		if (timer_triggered(&timer)) {
+			DEBUG("TLS handshake timed out on socket %d", conn->fd);
+			break;
+		}
+	}
+
+	timer_stop(&timer);
+	if (done)
+		conn->ktls_send = tls_ktls_send(conn->ssl);
+	return done;
+}
+
+/* Same semantics as read(2), on EAGAIN want_write tells if the connection
+ * needs to wait to be writable rather than readable.
+ */
+int conn_read(struct conn *conn, char *buf, int len)
+{
+	if (conn->ssl)
+		return tls_read(conn->ssl, buf, len, &conn->want_write);
+	return read(conn->fd, buf, len);
+}
+
+/* Limit the bytes per second sent on every new connection, zero for no
+ * limit.
+ */
+void conn_set_rate_limit(unsigned bytes_per_sec)
+{
+	send_rate_limit = bytes_per_sec;
+}
+
+static int sock_write(struct conn *conn, const char *buf, int len)
+{
+	if (len > SEND_QUANTUM)
+		len = SEND_QUANTUM;
+
+	// With kTLS the kernel does the encryption, write directly to the socket
+	if (conn->ssl && !conn->ktls_send)
+		return tls_write(conn->ssl, buf, len);
+	return write(conn->fd, buf, len);
+}
+
+/* The rate limit no longer applies once the server drains, the shaped
+ * responses go out at full speed so they don't hold up the exit.
+ */
+void conn_stop_shaping(void)
+{
+	shaping_stopped = true;
+}
+
+/* A token bucket that refills at the rate limit and holds up to a quantum,
+ * true when the connection is under its limit.
+ */
+bool conn_shape_ready(struct conn *conn)
+{
+	if (!conn->rate_limit || shaping_stopped)
+		return true;
+
+	unsigned now = now_msecs();
+	conn->shape_tokens += (long long)conn->rate_limit * (now - conn->shape_msecs) / 1000;
+	conn->shape_msecs = now;
+	if (conn->shape_tokens > SEND_QUANTUM)
+		conn->shape_tokens = SEND_QUANTUM;
+	return conn->shape_tokens >= 0;
+}
+
+// Sleep until the connection is back under its limit, or the server drains
+void conn_shape_wait(struct conn *conn)
+{
+	while (!conn_shape_ready(conn)) {
+		wire_timer_t timer;
+		if (!timer_start(&timer, -conn->shape_tokens * 1000 / conn->rate_limit + 1))
+			break;
+
+		wire_wait_list_t wait_list;
+		wire_wait_list_init(&wait_list);
+		timer_list_chain(&timer, &wait_list);
+		conn_idle_chain(conn, &wait_list);
+		wire_list_wait(&wait_list);
+		conn_idle_done(conn);
+		timer_stop(&timer);
+		conn->quantum_bytes = 0;
+	}
+}
+
+static void conn_shape(struct conn *conn, int len)
+{
+	conn->shape_tokens -= len;
+	if (!conn->shape_deferred)
+		conn_shape_wait(conn);
+}
+
+static void conn_sent(struct conn *conn, int len)
+{
+	trace_mark(&conn->trace, TRACE_FIRST_WRITE);
+
+	// Only the data sent since the client started to block matters for its rate
+	if (conn->send_deadline)
+		conn->window_bytes += len;
+
+	if (conn->rate_limit && !shaping_stopped)
+		conn_shape(conn, len);
+
+	conn->quantum_bytes += len;
+	if (conn->quantum_bytes >= SEND_QUANTUM) {
+		conn->quantum_bytes = 0;
+		wire_yield();
+	}
+}
+
+static bool conn_wait_write(struct conn *conn)
+{
+	unsigned now = now_msecs();
+
+	// A window that ended while the client wasn't blocked is not held against it
+	if (!conn->send_deadline || (int)(now - conn->send_deadline) >= 0) {
+		conn->window_start = now;
+		conn->window_bytes = 0;
+		conn->send_deadline = now + SEND_RATE_WINDOW_MSECS;
+	}
+
+	wire_wait_init(&conn->deadline_wait);
+	list_add_tail(&conn->blocked_list, &blocked_conns);
+	blocked_writers++;
+
+	wire_fd_mode_write(&conn->fd_state);
+	wire_wait_list_t wait_list;
+	wire_wait_list_init(&wait_list);
+	wire_fd_wait_list_chain(&wait_list, &conn->fd_state);
+	wire_wait_chain(&wait_list, &conn->deadline_wait);
+	wire_list_wait(&wait_list);
+	wire_fd_mode_none(&conn->fd_state);
+
+	list_del(&conn->blocked_list);
+	blocked_writers--;
+
+	// The others had their turn while we waited
+	conn->quantum_bytes = 0;
+
+	if (!conn->deadline_wait.triggered)
+		return true;
+
+	// Still blocked at the end of the window, it must have kept up over it
+	unsigned long long rate = conn->window_bytes * 1000 / (now_msecs() - conn->window_start);
+	conn->send_deadline = 0;
+	if (conn->window_bytes == 0) {
+		xlog("Client on socket %d stopped reading, closing it (%d blocked on write)", conn->fd, blocked_writers);
+		conn->write_timeout = true;
+		return false;
+	} else if (rate < MIN_SEND_RATE) {
+		xlog("Client on socket %d reads at %llu bytes/sec, closing it (%d blocked on write)", conn->fd, rate, blocked_writers);
+		conn->write_timeout = true;
+		return false;
+	}
+
+	return true;
+}
+
+/* Wakes the blocked writers whose window ended, one timer for all of them
+ * rather than one per blocked write.
+ */
+static void conn_deadline_run(void *arg)
+{
+	(void)arg;
+
+	while (1) {
+		wire_timer_t timer;
+		if (!timer_start(&timer, SEND_DEADLINE_CHECK_MSECS))
+			return;
+		wire_fd_wait(&timer.fd_state);
+		timer_stop(&timer);
+
+		unsigned now = now_msecs();
+		struct list_head *pos;
+		for (pos = blocked_conns.next; pos != &blocked_conns; pos = pos->next) {
+			struct conn *conn = list_entry(pos, struct conn, blocked_list);
+			if ((int)(now - conn->send_deadline) >= 0)
+				wire_wait_resume(&conn->deadline_wait);
+		}
+	}
+}
+
+void conn_start(void)
+{
+	list_head_init(&blocked_conns);
+	list_head_init(&idle_conns);
+	wire_init(&deadline_wire, "send deadlines", conn_deadline_run, NULL, WIRE_STACK_ALLOC(4096));
+}
+
+int buf_write(struct conn *conn, const char *buf, int len)
+{
+	int sent = 0;
+
+	if (conn->write_timeout)
+		return -1;
+
+	do {
+		int ret = sock_write(conn, buf + sent, len - sent);
+		if (ret == 0)
+			return -1;
+		else if (ret > 0) {
+			conn_sent(conn, ret);
+			sent += ret;
+			if (sent == len)
+				return 0;
+		} else {
+			// Error
+			if (errno == EINTR || errno == EAGAIN) {
+				if (!conn_wait_write(conn))
+					return -1;
+			} else {
+				xlog("Error while writing into socket %d: %m", conn->fd);
+				return -1;
+			}
+		}
+	} while (1);
+}
+
+/* Write a header and a payload from different buffers without copying them
+ * together, the iov is modified as the data is sent.
+ */
+int buf_writev(struct conn *conn, struct iovec *iov, int iovcnt)
+{
+	if (conn->write_timeout)
+		return -1;
+
+	if (conn->ssl && !conn->ktls_send) {
+		// OpenSSL copies the data anyway, no gain from a gather write
+		int i;
+		for (i = 0; i < iovcnt; i++) {
+			if (buf_write(conn, iov[i].iov_base, iov[i].iov_len) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	while (iovcnt > 0) {
+		// At most a quantum per call, the last entry is cut short for it
+		size_t total = 0;
+		size_t cut = 0;
+		int cnt = 0;
+		while (cnt < iovcnt && total < SEND_QUANTUM)
+			total += iov[cnt++].iov_len;
+		if (total > SEND_QUANTUM) {
+			cut = total - SEND_QUANTUM;
+			iov[cnt-1].iov_len -= cut;
+		}
+
+		ssize_t ret = writev(conn->fd, iov, cnt);
+		iov[cnt-1].iov_len += cut;
+		if (ret == 0)
+			return -1;
+		else if (ret > 0) {
+			conn_sent(conn, ret);
+			while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+				ret -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			}
+			if (iovcnt > 0) {
+				iov->iov_base = (char *)iov->iov_base + ret;
+				iov->iov_len -= ret;
+			}
+		} else {
+			// Error
+			if (errno == EINTR || errno == EAGAIN) {
+				if (!conn_wait_write(conn))
+					return -1;
+			} else {
+				xlog("Error while writing into socket %d: %m", conn->fd);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Move len bytes already in a pipe to the connection without copying them
+ * through user space, only for plain and kTLS connections.
+ */
+int buf_splice(struct conn *conn, int pipe_fd, int len)
+{
+	if (conn->write_timeout)
+		return -1;
+
+	while (len > 0) {
+		int count = len > SEND_QUANTUM ? SEND_QUANTUM : len;
+		ssize_t ret = splice(pipe_fd, NULL, conn->fd, NULL, count, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (ret == 0)
+			return -1;
+		else if (ret > 0) {
+			conn_sent(conn, ret);
+			len -= ret;
+		} else {
+			// Error
+			if (errno == EINTR || errno == EAGAIN) {
+				if (!conn_wait_write(conn))
+					return -1;
+			} else {
+				xlog("Error while splicing into socket %d: %m", conn->fd);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void conn_close(struct conn *conn)
+{
+	if (conn->write_timeout) {
+		// Reset the connection rather than keep the unsent data around
+		struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+		setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	}
+
+	if (conn->ssl)
+		tls_free(conn->ssl);
+	close(conn->fd);
+}
+
+int conn_blocked_writers(void)
+{
+	return blocked_writers;
+}
+
+/* A connection waiting for its next request joins the idle ones for the wait,
+ * they are all woken up when the server drains so they can close right away.
+ * So does a shaped connection sleeping off its rate.
+ */
+void conn_idle_chain(struct conn *conn, wire_wait_list_t *wait_list)
+{
+	wire_wait_init(&conn->idle_wait);
+	list_add_tail(&conn->idle_list, &idle_conns);
+	wire_wait_chain(wait_list, &conn->idle_wait);
+}
+
+void conn_idle_done(struct conn *conn)
+{
+	list_del(&conn->idle_list);
+}
+
+void conn_idle_wake(void)
+{
+	struct list_head *pos;
+
+	for (pos = idle_conns.next; pos != &idle_conns; pos = pos->next) {
+		struct conn *conn = list_entry(pos, struct conn, idle_list);
+		wire_wait_resume(&conn->idle_wait);
+	}
+}
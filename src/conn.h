@@ -0,0 +1,51 @@
+#include "wire_fd.h"
+#include "macros.h"
+#include "trace.h"
+
+#include <stdbool.h>
+#include <sys/uio.h>
+
+struct ssl_st;
+
+/* A client connection, plain or TLS. The reads are non-blocking and the
+ * writes block the wire until all the data is sent, a client that stops
+ * reading or reads too slowly fails the writes and should be closed.
+ */
+struct conn {
+	int fd;
+	struct ssl_st *ssl;
+	bool ktls_send;
+	bool want_write;
+	bool write_timeout;
+	unsigned send_deadline; // End of the send rate window in msecs, zero when none is running
+	unsigned window_start;
+	unsigned long long window_bytes; // Bytes sent in the window, a fast client can send more than 4GB
+	struct list_head blocked_list; // On the blocked writers while waiting to write
+	wire_wait_t deadline_wait;
+	struct list_head idle_list; // On the idle connections while waiting for a request
+	wire_wait_t idle_wait;
+	unsigned quantum_bytes; // Bytes sent since the wire last gave way to the others
+	unsigned rate_limit; // Bytes per second, zero when not shaped
+	bool shape_deferred; // The owner waits in conn_shape_wait rather than in the writes
+	long long shape_tokens;
+	unsigned shape_msecs;
+	wire_fd_state_t fd_state;
+	struct trace_req trace; // The current request on a client connection
+};
+
+void conn_start(void);
+void conn_init(struct conn *conn, int fd);
+void conn_set_rate_limit(unsigned bytes_per_sec);
+void conn_stop_shaping(void);
+bool conn_shape_ready(struct conn *conn);
+void conn_shape_wait(struct conn *conn);
+bool conn_tls_handshake(struct conn *conn, int timeout_msecs);
+int conn_read(struct conn *conn, char *buf, int len);
+int buf_write(struct conn *conn, const char *buf, int len);
+int buf_writev(struct conn *conn, struct iovec *iov, int iovcnt);
+int buf_splice(struct conn *conn, int pipe_fd, int len);
+void conn_close(struct conn *conn);
+int conn_blocked_writers(void);
+void conn_idle_chain(struct conn *conn, wire_wait_list_t *wait_list);
+void conn_idle_done(struct conn *conn);
+void conn_idle_wake(void);
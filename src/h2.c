@@ -0,0 +1,658 @@
+#include "h2.h"
+#include "conn.h"
+#include "cache.h"
+#include "proxy.h"
+#include "mime.h"
+#include "timer.h"
+#include "xlog.h"
+
+#include "wire_io.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN (sizeof(H2_PREFACE) - 1)
+
+bool h2_is_preface(const char *buf, int len)
+{
+	// Don't mistake the start of a request line for a preface on a tiny read
+	if (len < 4)
+		return false;
+	if ((size_t)len > H2_PREFACE_LEN)
+		len = H2_PREFACE_LEN;
+	return memcmp(buf, H2_PREFACE, len) == 0;
+}
+
+#ifdef HAVE_NGHTTP2
+
+#include <nghttp2/nghttp2.h>
+
+#define INDEX_FILE_NAME "index.html"
+#define H2_MAX_STREAMS 32
+#define H2_IDLE_TIMEOUT_MSECS 10*1000
+#define H2_READ_BUF_SIZE 4096
+
+/* The framing, HPACK and flow control are handled by nghttp2, the DATA frames
+ * of cached files are written straight from the cache buffers.
+ */
+
+struct h2_stream {
+	int32_t id; // Zero when the slot is free
+	bool head;
+	bool bad_method;
+	char path[255];
+	char if_modified_since[32];
+	char last_modified[32];
+	char content_length[24];
+	const char *buf; // Cache buffer or static error body
+	void *release_data;
+	int fd;
+	off_t size;
+	off_t offset;
+	bool deferred; // Held back by the rate limit
+	bool pending; // Received in full, looked up once the frames are processed
+	struct trace_req trace;
+};
+
+struct h2_session {
+	struct conn *conn;
+	nghttp2_session *session;
+	struct h2_stream streams[H2_MAX_STREAMS];
+};
+
+bool h2_supported(void)
+{
+	return true;
+}
+
+static struct h2_stream *h2_stream_alloc(struct h2_session *h2, int32_t stream_id)
+{
+	int i;
+	for (i = 0; i < H2_MAX_STREAMS; i++) {
+		struct h2_stream *stream = &h2->streams[i];
+		if (stream->id == 0) {
+			memset(stream, 0, sizeof(*stream));
+			stream->id = stream_id;
+			stream->fd = -1;
+			trace_next(&stream->trace, &h2->conn->trace);
+			trace_mark(&stream->trace, TRACE_FIRST_READ);
+			return stream;
+		}
+	}
+
+	return NULL;
+}
+
+static void h2_stream_free(struct h2_stream *stream)
+{
+	if (stream->release_data)
+		cache_release(stream->release_data);
+	if (stream->fd >= 0)
+		wio_close(stream->fd);
+	stream->id = 0;
+}
+
+static bool h2_stream_set_path(struct h2_stream *stream, const char *path, size_t len)
+{
+	size_t extra_len = 0;
+
+	if (len == 0 || path[0] != '/')
+		return false;
+
+	if (path[len-1] == '/')
+		extra_len = strlen(INDEX_FILE_NAME);
+
+	if (len + extra_len >= sizeof(stream->path)) {
+		xlog("Error while handling path, it's length is %u and the max length is %u", len + extra_len, sizeof(stream->path));
+		return false;
+	}
+
+	memcpy(stream->path, path, len);
+	if (extra_len) {
+		memcpy(stream->path + len, INDEX_FILE_NAME, extra_len);
+		len += extra_len;
+	}
+	stream->path[len] = 0;
+	return true;
+}
+
+static ssize_t h2_data_read(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+		uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+	struct h2_session *h2 = user_data;
+	struct h2_stream *stream = source->ptr;
+	off_t left = stream->size - stream->offset;
+	off_t end;
+
+	(void)session;
+	(void)stream_id;
+
+	// The other frames still go out, h2_run resumes the data once under the rate
+	if (!conn_shape_ready(h2->conn)) {
+		stream->deferred = true;
+		return NGHTTP2_ERR_DEFERRED;
+	}
+
+	if ((off_t)length > left)
+		length = left;
+
+	if (stream->buf) {
+		// Sent by h2_send_data directly from the buffer
+		*data_flags |= NGHTTP2_DATA_FLAG_NO_COPY;
+		end = stream->offset + length;
+	} else {
+		int ret = wio_pread(stream->fd, buf, length, stream->offset);
+		if (ret <= 0) {
+			xlog("Error while reading file %s, ret=%d errno=%d: %m", stream->path, ret, errno);
+			return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+		}
+		length = ret;
+		stream->offset += ret;
+		end = stream->offset;
+	}
+
+	if (end == stream->size)
+		*data_flags |= NGHTTP2_DATA_FLAG_EOF;
+
+	return length;
+}
+
+static int h2_send_data(nghttp2_session *session, nghttp2_frame *frame, const uint8_t *framehd, size_t length,
+		nghttp2_data_source *source, void *user_data)
+{
+	static const char padding[256];
+	struct h2_session *h2 = user_data;
+	struct h2_stream *stream = source->ptr;
+	struct iovec iov[4];
+	uint8_t pad_len = 0;
+	int iovcnt = 0;
+
+	(void)session;
+
+	iov[iovcnt].iov_base = (void *)framehd;
+	iov[iovcnt++].iov_len = 9;
+
+	if (frame->data.padlen > 0) {
+		pad_len = frame->data.padlen - 1;
+		iov[iovcnt].iov_base = &pad_len;
+		iov[iovcnt++].iov_len = 1;
+	}
+
+	if (length > 0) {
+		iov[iovcnt].iov_base = (void *)(stream->buf + stream->offset);
+		iov[iovcnt++].iov_len = length;
+	}
+
+	if (pad_len > 0) {
+		iov[iovcnt].iov_base = (void *)padding;
+		iov[iovcnt++].iov_len = pad_len;
+	}
+
+	if (buf_writev(h2->conn, iov, iovcnt) < 0)
+		return NGHTTP2_ERR_CALLBACK_FAILURE;
+
+	trace_mark(&stream->trace, TRACE_FIRST_WRITE);
+	stream->offset += length;
+	return 0;
+}
+
+static ssize_t h2_send(nghttp2_session *session, const uint8_t *data, size_t length, int flags, void *user_data)
+{
+	struct h2_session *h2 = user_data;
+
+	(void)session;
+	(void)flags;
+
+	if (buf_write(h2->conn, (const char *)data, length) < 0)
+		return NGHTTP2_ERR_CALLBACK_FAILURE;
+	return length;
+}
+
+#define MAKE_NV(name, value) { (uint8_t *)name, (uint8_t *)value, sizeof(name) - 1, strlen(value), NGHTTP2_NV_FLAG_NONE }
+
+static void h2_respond(struct h2_session *h2, struct h2_stream *stream, const char *status, const char *content_type, bool with_body)
+{
+	snprintf(stream->content_length, sizeof(stream->content_length), "%u", (unsigned)stream->size);
+
+	nghttp2_nv hdrs[] = {
+		MAKE_NV(":status", status),
+		MAKE_NV("content-type", content_type),
+		MAKE_NV("content-length", stream->content_length),
+		MAKE_NV("cache-control", "max_age=3600"),
+		MAKE_NV("last-modified", stream->last_modified),
+	};
+	int num_hdrs = sizeof(hdrs) / sizeof(hdrs[0]);
+	if (!stream->last_modified[0])
+		num_hdrs--;
+
+	nghttp2_data_provider data_prd = {
+		.source.ptr = stream,
+		.read_callback = h2_data_read,
+	};
+
+	int ret = nghttp2_submit_response(h2->session, stream->id, hdrs, num_hdrs, with_body ? &data_prd : NULL);
+	if (ret < 0)
+		xlog("Failed to submit response on stream %d: %s", stream->id, nghttp2_strerror(ret));
+}
+
+static void h2_respond_error(struct h2_session *h2, struct h2_stream *stream, const char *status, const char *body)
+{
+	stream->buf = body;
+	stream->size = strlen(body);
+	stream->last_modified[0] = 0;
+	h2_respond(h2, stream, status, "text/plain", !stream->head);
+}
+
+static void h2_request(struct h2_session *h2, struct h2_stream *stream)
+{
+	const char *filename = stream->path + 1;
+	int fd;
+
+	// Proxied requests are only forwarded over HTTP/1.1, the client retries with it
+	if (proxy_match(stream->path, strlen(stream->path))) {
+		nghttp2_submit_rst_stream(h2->session, NGHTTP2_FLAG_NONE, stream->id, NGHTTP2_HTTP_1_1_REQUIRED);
+		return;
+	}
+
+	if (stream->bad_method) {
+		h2_respond_error(h2, stream, "405", "Invalid method used");
+		return;
+	}
+
+	if (!stream->path[0]) {
+		h2_respond_error(h2, stream, "400", "Invalid path\n");
+		return;
+	}
+
+	const char *buf = cache_get(filename, &stream->size, stream->last_modified, &fd, &stream->release_data);
+	trace_mark(&stream->trace, TRACE_CACHE_DONE);
+
+	if (stream->if_modified_since[0] && strcmp(stream->if_modified_since, stream->last_modified) == 0) {
+		DEBUG("Not modified");
+		if (fd >= 0)
+			wio_close(fd);
+		h2_respond(h2, stream, "304", content_type_from_filename(filename), false);
+		return;
+	}
+
+	if (buf) {
+		// File in cache, the DATA frames are sent from the buffer
+		stream->buf = buf;
+	} else if (fd >= 0) {
+		// No space in cache or file too large, read it as it is sent
+		stream->fd = fd;
+	} else {
+		// File is missing or some other error when opening/reading
+		switch (fd) {
+			case -2: h2_respond_error(h2, stream, "404", "File not found\n"); break;
+			case -3: h2_respond_error(h2, stream, "500", "Error getting info on file\n"); break;
+			default: h2_respond_error(h2, stream, "500", "Unknown internal error\n"); break;
+		}
+		return;
+	}
+
+	h2_respond(h2, stream, "200", content_type_from_filename(filename), !stream->head);
+}
+
+static int h2_on_begin_headers(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+	struct h2_session *h2 = user_data;
+
+	if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+		return 0;
+
+	struct h2_stream *stream = h2_stream_alloc(h2, frame->hd.stream_id);
+	if (!stream) {
+		nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, frame->hd.stream_id, NGHTTP2_REFUSED_STREAM);
+		return 0;
+	}
+
+	nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream);
+	return 0;
+}
+
+static bool h2_header_is(const uint8_t *name, size_t namelen, const char *expected)
+{
+	return namelen == strlen(expected) && memcmp(name, expected, namelen) == 0;
+}
+
+static int h2_on_header(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name, size_t namelen,
+		const uint8_t *value, size_t valuelen, uint8_t flags, void *user_data)
+{
+	(void)flags;
+	(void)user_data;
+
+	if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+		return 0;
+
+	struct h2_stream *stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+	if (!stream)
+		return 0;
+
+	if (h2_header_is(name, namelen, ":method")) {
+		stream->head = h2_header_is(value, valuelen, "HEAD");
+		stream->bad_method = !stream->head && !h2_header_is(value, valuelen, "GET");
+	} else if (h2_header_is(name, namelen, ":path")) {
+		if (!h2_stream_set_path(stream, (const char *)value, valuelen))
+			stream->path[0] = 0;
+	} else if (h2_header_is(name, namelen, "if-modified-since")) {
+		if (valuelen < sizeof(stream->if_modified_since)) {
+			memcpy(stream->if_modified_since, value, valuelen);
+			stream->if_modified_since[valuelen] = 0;
+		}
+	}
+
+	return 0;
+}
+
+static int h2_on_frame_recv(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+	(void)user_data;
+
+	if (frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA)
+		return 0;
+
+	if (!(frame->hd.flags & NGHTTP2_FLAG_END_STREAM))
+		return 0;
+
+	// The lookup may block on the disk, it is done after nghttp2_session_mem_recv
+	// so that the frames of the other streams are processed meanwhile
+	struct h2_stream *stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+	if (stream) {
+		trace_mark(&stream->trace, TRACE_PARSED);
+		stream->pending = true;
+	}
+	return 0;
+}
+
+static int h2_on_stream_close(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user_data)
+{
+	(void)error_code;
+	(void)user_data;
+
+	struct h2_stream *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+	if (stream) {
+		trace_done(&stream->trace);
+		h2_stream_free(stream);
+	}
+	return 0;
+}
+
+static bool h2_session_init(struct h2_session *h2, struct conn *conn)
+{
+	nghttp2_session_callbacks *callbacks;
+
+	memset(h2, 0, sizeof(*h2));
+	h2->conn = conn;
+	// Sleeping in the send callbacks would hold up every stream
+	conn->shape_deferred = true;
+
+	// Frames are small and interleaved, don't let Nagle hold them back while
+	// waiting for a WINDOW_UPDATE
+	int one = 1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (nghttp2_session_callbacks_new(&callbacks) != 0)
+		return false;
+
+	nghttp2_session_callbacks_set_send_callback(callbacks, h2_send);
+	nghttp2_session_callbacks_set_send_data_callback(callbacks, h2_send_data);
+	nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, h2_on_begin_headers);
+	nghttp2_session_callbacks_set_on_header_callback(callbacks, h2_on_header);
+	nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, h2_on_frame_recv);
+	nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, h2_on_stream_close);
+
+	int ret = nghttp2_session_server_new(&h2->session, callbacks, h2);
+	nghttp2_session_callbacks_del(callbacks);
+	if (ret != 0) {
+		xlog("Failed to create an HTTP/2 session: %s", nghttp2_strerror(ret));
+		return false;
+	}
+
+	nghttp2_settings_entry settings[] = {
+		{ NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS },
+	};
+	nghttp2_submit_settings(h2->session, NGHTTP2_FLAG_NONE, settings, sizeof(settings) / sizeof(settings[0]));
+	return true;
+}
+
+static void h2_session_close(struct h2_session *h2)
+{
+	int i;
+
+	// Deleting the session doesn't call the stream close callback
+	nghttp2_session_del(h2->session);
+
+	for (i = 0; i < H2_MAX_STREAMS; i++) {
+		if (h2->streams[i].id)
+			h2_stream_free(&h2->streams[i]);
+	}
+}
+
+static bool h2_wait(struct h2_session *h2)
+{
+	wire_timer_t timer;
+	bool ready;
+
+	if (!timer_start(&timer, H2_IDLE_TIMEOUT_MSECS))
+		return false;
+
+	if (h2->conn->want_write)
+		wire_fd_mode_write(&h2->conn->fd_state);
+	else
+		wire_fd_mode_read(&h2->conn->fd_state);
+
+	wire_wait_list_t wait_list;
+	wire_wait_list_init(&wait_list);
+	wire_fd_wait_list_chain(&wait_list, &h2->conn->fd_state);
+	timer_list_chain(&timer, &wait_list);
+	// Woken up on a drain to send the GOAWAY
+	conn_idle_chain(h2->conn, &wait_list);
+	wire_list_wait(&wait_list);
+	conn_idle_done(h2->conn);
+
+	ready = !timer_triggered(&timer);
+	wire_fd_mode_none(&h2->conn->fd_state);
+	timer_stop(&timer);
+	return ready;
+}
+
+static bool h2_recv(struct h2_session *h2, const char *data, int len)
+{
+	int ret = nghttp2_session_mem_recv(h2->session, (const uint8_t *)data, len);
+	if (ret < 0) {
+		DEBUG("HTTP/2 receive failed: %s", nghttp2_strerror(ret));
+		return false;
+	}
+
+	int i;
+	for (i = 0; i < H2_MAX_STREAMS; i++) {
+		struct h2_stream *stream = &h2->streams[i];
+		if (stream->id && stream->pending) {
+			stream->pending = false;
+			h2_request(h2, stream);
+		}
+	}
+
+	return true;
+}
+
+// Sleeps off the rate limit outside of nghttp2 and gives the data back to the streams
+static bool h2_resume_deferred(struct h2_session *h2)
+{
+	bool resumed = false;
+	int i;
+
+	for (i = 0; i < H2_MAX_STREAMS; i++) {
+		struct h2_stream *stream = &h2->streams[i];
+		if (!stream->id || !stream->deferred)
+			continue;
+
+		if (!resumed)
+			conn_shape_wait(h2->conn);
+		stream->deferred = false;
+		nghttp2_session_resume_data(h2->session, stream->id);
+		resumed = true;
+	}
+
+	return resumed;
+}
+
+static void h2_run(struct h2_session *h2, const char *data, int len, const bool *draining)
+{
+	char buf[H2_READ_BUF_SIZE];
+	bool goaway_sent = false;
+
+	if (len > 0 && !h2_recv(h2, data, len))
+		return;
+
+	while (nghttp2_session_want_read(h2->session) || nghttp2_session_want_write(h2->session)) {
+		if (*draining && !goaway_sent) {
+			// Let the in-flight streams finish but accept no new ones
+			nghttp2_submit_goaway(h2->session, NGHTTP2_FLAG_NONE, nghttp2_session_get_last_proc_stream_id(h2->session),
+					NGHTTP2_NO_ERROR, NULL, 0);
+			goaway_sent = true;
+		}
+
+		// Send all that can be sent now, interleaving the active streams
+		int ret = nghttp2_session_send(h2->session);
+		if (ret != 0) {
+			DEBUG("HTTP/2 send failed: %s", nghttp2_strerror(ret));
+			break;
+		}
+
+		if (h2_resume_deferred(h2))
+			continue;
+
+		if (!nghttp2_session_want_read(h2->session) && !nghttp2_session_want_write(h2->session))
+			break;
+
+		int received = conn_read(h2->conn, buf, sizeof(buf));
+		if (received > 0) {
+			if (!h2_recv(h2, buf, received))
+				break;
+		} else if (received == 0) {
+			DEBUG("Received EOF");
+			break;
+		} else if (errno == EINTR || errno == EAGAIN) {
+			if (!h2_wait(h2)) {
+				DEBUG("HTTP/2 connection idle, closing");
+				break;
+			}
+		} else {
+			DEBUG("Error receiving from socket %d: %m", h2->conn->fd);
+			break;
+		}
+	}
+}
+
+void h2_serve(struct conn *conn, const char *data, int len, const bool *draining)
+{
+	struct h2_session h2;
+
+	if (!h2_session_init(&h2, conn))
+		return;
+
+	h2_run(&h2, data, len, draining);
+	h2_session_close(&h2);
+}
+
+static int base64url_value(char c)
+{
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '-' || c == '+') return 62;
+	if (c == '_' || c == '/') return 63;
+	return -1;
+}
+
+static int base64url_decode(const char *in, uint8_t *out, int out_size)
+{
+	unsigned bits = 0;
+	int num_bits = 0;
+	int len = 0;
+
+	for (; *in && *in != '='; in++) {
+		int val = base64url_value(*in);
+		if (val < 0)
+			return -1;
+
+		bits = (bits << 6) | val;
+		num_bits += 6;
+		if (num_bits >= 8) {
+			num_bits -= 8;
+			if (len == out_size)
+				return -1;
+			out[len++] = bits >> num_bits;
+		}
+	}
+
+	return len;
+}
+
+void h2_serve_upgrade(struct conn *conn, const struct h2_upgrade *upgrade, const char *data, int len, const bool *draining)
+{
+	struct h2_session h2;
+	uint8_t settings[128];
+
+	int settings_len = base64url_decode(upgrade->settings, settings, sizeof(settings));
+	if (settings_len < 0) {
+		DEBUG("Invalid HTTP2-Settings header");
+		return;
+	}
+
+	if (!h2_session_init(&h2, conn))
+		return;
+
+	// The upgraded request becomes stream 1 and is answered over HTTP/2
+	struct h2_stream *stream = h2_stream_alloc(&h2, 1);
+	stream->trace = conn->trace; // Read and parsed as HTTP/1.1
+	stream->head = upgrade->head;
+	strcpy(stream->path, upgrade->path);
+	if (strlen(upgrade->if_modified_since) < sizeof(stream->if_modified_since))
+		strcpy(stream->if_modified_since, upgrade->if_modified_since);
+
+	int ret = nghttp2_session_upgrade2(h2.session, settings, settings_len, upgrade->head, stream);
+	if (ret != 0) {
+		xlog("Failed to upgrade to HTTP/2: %s", nghttp2_strerror(ret));
+		stream->id = 0;
+		h2_session_close(&h2);
+		return;
+	}
+
+	h2_request(&h2, stream);
+	h2_run(&h2, data, len, draining);
+	h2_session_close(&h2);
+}
+
+#else
+
+bool h2_supported(void)
+{
+	return false;
+}
+
+void h2_serve(struct conn *conn, const char *data, int len, const bool *draining)
+{
+	(void)conn;
+	(void)data;
+	(void)len;
+	(void)draining;
+}
+
+void h2_serve_upgrade(struct conn *conn, const struct h2_upgrade *upgrade, const char *data, int len, const bool *draining)
+{
+	(void)conn;
+	(void)upgrade;
+	(void)data;
+	(void)len;
+	(void)draining;
+}
+
+#endif
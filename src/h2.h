@@ -0,0 +1,20 @@
+#include <stdbool.h>
+
+struct conn;
+
+/* HTTP/2 is served either with prior knowledge (the client starts with the
+ * connection preface), with an Upgrade: h2c of an HTTP/1.1 request or by ALPN
+ * on a TLS connection.
+ */
+
+struct h2_upgrade {
+	const char *settings; // The base64url HTTP2-Settings header
+	const char *path;
+	const char *if_modified_since;
+	bool head;
+};
+
+bool h2_supported(void);
+bool h2_is_preface(const char *buf, int len);
+void h2_serve(struct conn *conn, const char *data, int len, const bool *draining);
+void h2_serve_upgrade(struct conn *conn, const struct h2_upgrade *upgrade, const char *data, int len, const bool *draining);
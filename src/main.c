@@ -1,4 +1,13 @@
 #include "cache.h"
+#include "prefork.h"
+#include "upgrade.h"
+#include "tls.h"
+#include "conn.h"
+#include "timer.h"
+#include "mime.h"
+#include "h2.h"
+#include "proxy.h"
+#include "state.h"
 #include "xlog.h"
 
 #include "wire.h"
@@ -10,137 +19,87 @@
 #include "http_parser.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <memory.h>
+#include <strings.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <stdbool.h>
-#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 #include <time.h>
 
 #include "libwire/test/utils.h"
-#include "gperf.h"
 
 #define INDEX_FILE_NAME "index.html"
 #define IF_MODIFIED_SINCE_HDR "If-Modified-Since"
+#define UPGRADE_HDR "Upgrade"
+#define HTTP2_SETTINGS_HDR "HTTP2-Settings"
 #define WEB_POOL_SIZE 128
+#define PORT 9090
+#define TLS_PORT 9443
+#define DRAIN_TIMEOUT_MSECS 30*1000
+#define DEFER_ACCEPT_SECS 10
+#define FASTOPEN_QUEUE_LEN 256
+#define MAX_RATE_KB 1024*1024 // 1GB/s, well within the unsigned rate in bytes
 
 // DATA_BUF_SIZE is for the data to be read from the filesystem, leave a little
 // space since the rounding up to 4K is the stack space for the rest of the
-// wire data structures
+// wire data structures. The web_data of the connection stays on the stack
+// under all of them, it holds the URL and the head of a proxied request.
 #define DATA_BUF_SIZE 64*1024
-#define WIRE_DATA_SIZE 16*1024
+#define WIRE_DATA_SIZE (16*1024 + sizeof(struct web_data))
+
+struct listener {
+	int fd;
+	bool tls;
+	wire_t wire;
+	wire_wait_t stop;
+};
 
 static wire_thread_t wire_thread_main;
-static wire_t wire_accept;
+static wire_t wire_control;
 static wire_pool_t web_pool;
+static struct listener listener_http;
+static struct listener listener_https;
+
+/* On shutdown or upgrade the accept wires are stopped and the server waits for
+ * the active connections to finish, keep-alive connections are closed after
+ * their current request.
+ */
+static bool draining;
+static int active_conns;
+static wire_wait_t drained; // Resumed when the last connection is done draining
+static struct upgrade_fds server_fds = { .listen_fd = -1, .tls_listen_fd = -1, .cache_fd = -1 };
+static int upgrade_fd = -1;
+
+enum web_header {
+	HDR_OTHER,
+	HDR_IF_MODIFIED_SINCE,
+	HDR_UPGRADE,
+	HDR_HTTP2_SETTINGS,
+};
 
 struct web_data {
-	int fd;
+	struct conn conn;
 	bool should_close;
-	bool next_hdr_val_if_modified_since;
+	bool in_message; // Part of a request was received, the connection isn't idle
+	bool has_http2_settings;
+	enum web_header next_hdr_val;
 	char if_modified_since[32];
-	wire_fd_state_t fd_state;
-	char url[255];
+	char upgrade[16];
+	char http2_settings[128];
+	char url[2048];
+	size_t url_len;
+	bool url_done; // The URL is complete and the request routed
+	struct proxy_req proxy;
 };
 
-typedef struct wire_timer {
-	int timerfd;
-	wire_fd_state_t fd_state;
-} wire_timer_t;
-
-static bool timer_start(wire_timer_t *timer, int msecs)
-{
-	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
-	if (fd < 0) {
-		perror("Failed to create a timerfd");
-		return false;
-	}
-
-	struct itimerspec timer_val = {
-		.it_value = { .tv_sec = msecs / 1000, .tv_nsec = (msecs % 1000) * 1000000}
-	};
-
-	int ret = timerfd_settime(fd, 0, &timer_val, NULL);
-	if (ret < 0) {
-		perror("Failed to set time on timerfd");
-		close(fd);
-		return false;
-	}
-
-	timer->timerfd = fd;
-
-	wire_fd_mode_init(&timer->fd_state, fd);
-	wire_fd_mode_read(&timer->fd_state);
-
-	return true;
-}
-
-static void timer_stop(wire_timer_t *timer)
-{
-	wire_fd_mode_none(&timer->fd_state);
-	close(timer->timerfd);
-}
-
-static bool timer_triggered(wire_timer_t *timer)
-{
-	return timer->fd_state.wait.triggered;
-}
-
-static void timer_list_chain(wire_timer_t *timer, wire_wait_list_t *list)
-{
-	wire_fd_wait_list_chain(list, &timer->fd_state);
-}
-
-static int buf_write(wire_fd_state_t *fd_state, const char *buf, int len)
-{
-	int sent = 0;
-	do {
-		int ret = write(fd_state->fd, buf + sent, len - sent);
-		if (ret == 0)
-			return -1;
-		else if (ret > 0) {
-			sent += ret;
-			if (sent == len)
-				return 0;
-		} else {
-			// Error
-			if (errno == EINTR || errno == EAGAIN) {
-				wire_fd_mode_write(fd_state);
-				wire_fd_wait(fd_state);
-				wire_fd_mode_none(fd_state);
-			} else {
-				xlog("Error while writing into socket %d: %m", fd_state->fd);
-				return -1;
-			}
-		}
-	} while (1);
-}
-
-static const char *content_type_from_filename(const char *filename)
-{
-	const char *last_dot = NULL;
-	int len = 0;
-
-	for (; *filename; filename++, len++) {
-		switch (*filename) {
-			case '.': last_dot = filename; len = 0; break;
-			case '/': last_dot = NULL; break;
-		}
-	}
-
-	if (last_dot == NULL)
-		return "text/plain";
-
-	const char *suffix = mime_from_suffix_name(last_dot+1, len-1);
-	if (suffix)
-		return suffix;
-	return "application/binary";
-}
-
 static void error_generic(struct web_data *d, int code, const char *code_str, const char *body, int body_len) __attribute__((noinline));
 static void error_generic(struct web_data *d, int code, const char *code_str, const char *body, int body_len)
 {
@@ -150,19 +109,24 @@ static void error_generic(struct web_data *d, int code, const char *code_str, co
 
 	d->should_close = true;
 
-	if (buf_write(&d->fd_state, buf, buf_len) < 0)
+	if (buf_write(&d->conn, buf, buf_len) < 0)
 		return;
 
 	if (body_len > 0)
-		buf_write(&d->fd_state, body, body_len);
+		buf_write(&d->conn, body, body_len);
 }
 
 #define STR_WITH_LEN(s) s, strlen(s)
 
+// Missing files are answered from memory, rendered once
+static const char not_found_response[] = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 15\r\nConnection:close\r\n\r\n"
+                                         "File not found\n";
+
 static void error_not_found(struct web_data *d) __attribute__((noinline));
 static void error_not_found(struct web_data *d)
 {
-	error_generic(d, 404, "Not Found", STR_WITH_LEN("File not found\n"));
+	d->should_close = true;
+	buf_write(&d->conn, not_found_response, sizeof(not_found_response) - 1);
 }
 
 static void error_internal(struct web_data *d, const char *msg, int msg_len) __attribute__((noinline));
@@ -176,13 +140,18 @@ static void error_invalid(struct web_data *d)
 	error_generic(d, 405, "Internal Method", STR_WITH_LEN("Invalid method used"));
 }
 
-static bool send_header(http_parser *parser, int code, const char *code_msg, const char *filename, off_t file_size, const char *last_modified) __attribute__((noinline));
-static bool send_header(http_parser *parser, int code, const char *code_msg, const char *filename, off_t file_size, const char *last_modified)
+static void error_proxy(struct web_data *d, int code)
 {
-	char data[2048];
-	struct web_data *d = parser->data;
-	int buf_len;
+	switch (code) {
+		case 431: error_generic(d, 431, "Request Header Fields Too Large", STR_WITH_LEN("Request header too large\n")); break;
+		case 503: error_generic(d, 503, "Service Unavailable", STR_WITH_LEN("Backend busy\n")); break;
+		case 504: error_generic(d, 504, "Gateway Timeout", STR_WITH_LEN("Backend timed out\n")); break;
+		default: error_generic(d, 502, "Bad Gateway", STR_WITH_LEN("Backend unavailable\n")); break;
+	}
+}
 
+static int format_header(http_parser *parser, char *data, int data_len, int code, const char *code_msg, const char *filename, off_t file_size, const char *last_modified)
+{
 	int http_major = 1;
 	int http_minor = 1;
 
@@ -193,24 +162,33 @@ static bool send_header(http_parser *parser, int code, const char *code_msg, con
 		http_minor = parser->http_minor;
 	}
 
-	buf_len = snprintf(data, sizeof(data), "HTTP/%d.%d %d %s\r\n"
-	                                       "Content-Type: %s\r\n"
-	                                       "Content-Length: %u\r\n"
-	                                       "Cache-Control: max_age=3600\r\n"
-	                                       "Last-Modified: %s\r\n"
-	                                       "%s"
-	                                       "\r\n",
+	return snprintf(data, data_len, "HTTP/%d.%d %d %s\r\n"
+	                                "Content-Type: %s\r\n"
+	                                "Content-Length: %u\r\n"
+	                                "Cache-Control: max_age=3600\r\n"
+	                                "Last-Modified: %s\r\n"
+	                                "%s"
+	                                "\r\n",
 			http_major, http_minor,
 			code, code_msg,
 			content_type_from_filename(filename),
 			(unsigned)file_size,
 			last_modified,
 			!http_should_keep_alive(parser) ? "Connection: close\r\n" : "");
+}
+
+static bool send_header(http_parser *parser, int code, const char *code_msg, const char *filename, off_t file_size, const char *last_modified) __attribute__((noinline));
+static bool send_header(http_parser *parser, int code, const char *code_msg, const char *filename, off_t file_size, const char *last_modified)
+{
+	char data[2048];
+	struct web_data *d = parser->data;
+
+	int buf_len = format_header(parser, data, sizeof(data), code, code_msg, filename, file_size, last_modified);
 	if (buf_len > (int)sizeof(data)) {
 		error_internal(d, STR_WITH_LEN("Failed to prepare header buffer"));
 		return false;
 	}
-	if (buf_write(&d->fd_state, data, buf_len) < 0)
+	if (buf_write(&d->conn, data, buf_len) < 0)
 		return false;
 	return true;
 }
@@ -250,7 +228,7 @@ static void send_file(int fd, off_t file_size, http_parser *parser, const char *
 		}
 		offset += ret;
 
-		if (buf_write(&d->fd_state, data, ret) < 0)
+		if (buf_write(&d->conn, data, ret) < 0)
 			return;
 	}
 }
@@ -266,13 +244,18 @@ static void send_cached_file(http_parser *parser, const char *filename, const ch
 	if (only_head)
 		return;
 
-	if (buf_write(&d->fd_state, buf, buf_len) < 0)
+	if (buf_write(&d->conn, buf, buf_len) < 0)
 		return;
 }
 
-static int on_message_complete(http_parser *parser)
+static bool web_upgrade_h2c(http_parser *parser)
+{
+	struct web_data *d = parser->data;
+	return parser->upgrade && h2_supported() && d->has_http2_settings && strcasecmp(d->upgrade, "h2c") == 0;
+}
+
+static int web_respond(http_parser *parser)
 {
-	DEBUG("message complete");
 	struct web_data *d = parser->data;
 	const char *filename = d->url+1;
 	off_t buf_len;
@@ -288,15 +271,23 @@ static int on_message_complete(http_parser *parser)
 		return -1;
 	}
 
+	if (web_upgrade_h2c(parser)) {
+		// The response is sent over HTTP/2 once the connection is upgraded
+		return 0;
+	}
+
 	bool only_head = parser->method == HTTP_HEAD;
 
 	const char *buf = cache_get(filename, &buf_len, last_modified, &fd, &release_data);
+	trace_mark(&d->conn.trace, TRACE_CACHE_DONE);
 
 	DEBUG("If modified since is '%s' last modified is '%s'", d->if_modified_since, last_modified);
 	if (d->if_modified_since[0] && strcmp(d->if_modified_since, last_modified) == 0) {
 		DEBUG("Not modified");
 		if (fd >= 0)
 			wio_close(fd);
+		if (buf)
+			cache_release(release_data);
 		if (!send_header_unmodified(parser, filename, buf_len, last_modified)) {
 			d->should_close = true;
 			return -1;
@@ -324,12 +315,91 @@ static int on_message_complete(http_parser *parser)
 	return -1;
 }
 
+static int web_proxy_respond(http_parser *parser)
+{
+	struct web_data *d = parser->data;
+	bool client_close = false;
+
+	int ret = proxy_request_done(&d->proxy, &d->conn, parser, &client_close);
+	if (ret > 0)
+		error_proxy(d, ret);
+
+	if (ret != 0 || client_close || !http_should_keep_alive(parser)) {
+		d->should_close = true;
+		return -1;
+	}
+	return 0;
+}
+
+static int on_message_complete(http_parser *parser)
+{
+	DEBUG("message complete");
+	struct web_data *d = parser->data;
+
+	d->in_message = false;
+
+	trace_mark(&d->conn.trace, TRACE_PARSED);
+	if (d->proxy.route) {
+		int ret = web_proxy_respond(parser);
+		trace_done(&d->conn.trace);
+		return ret;
+	}
+
+	int ret = web_respond(parser);
+	// An upgraded request is traced by HTTP/2
+	if (!web_upgrade_h2c(parser))
+		trace_done(&d->conn.trace);
+	return ret;
+}
+
+/* The header values are appended to as they come, start every request on a
+ * keep-alive connection from a clean slate.
+ */
+static int on_message_begin(http_parser *parser)
+{
+	struct web_data *d = parser->data;
+
+	d->has_http2_settings = false;
+	d->next_hdr_val = HDR_OTHER;
+	d->if_modified_since[0] = 0;
+	d->upgrade[0] = 0;
+	d->http2_settings[0] = 0;
+	d->url[0] = 0;
+	d->url_len = 0;
+	d->url_done = false;
+	d->in_message = true;
+	return 0;
+}
+
+/* The URL may come in several pieces when it spans reads, it is only complete
+ * once the headers start.
+ */
 static int on_url(http_parser *parser, const char *at, size_t length)
 {
-	UNUSED(parser);
 	DEBUG("URL: %.*s", (int)length, at);
 	struct web_data *d = parser->data;
-	size_t extra_len = 0;
+
+	if (d->url_len + length >= sizeof(d->url)) {
+		xlog("Error while handling url, it's length is %zu and the max length is %zu", d->url_len + length, sizeof(d->url) - 1);
+		error_internal(d, STR_WITH_LEN("url too long\n"));
+		return -1;
+	}
+
+	memcpy(d->url + d->url_len, at, length);
+	d->url_len += length;
+	d->url[d->url_len] = 0;
+	return 0;
+}
+
+// Route the request once its URL is complete
+static int web_url_done(http_parser *parser)
+{
+	struct web_data *d = parser->data;
+	size_t length = d->url_len;
+
+	if (d->url_done)
+		return 0;
+	d->url_done = true;
 
 	if (length == 0) {
 		xlog("URL length cannot be zero");
@@ -337,75 +407,187 @@ static int on_url(http_parser *parser, const char *at, size_t length)
 		return -1;
 	}
 
-	if (at[length-1] == '/')
-		extra_len = strlen(INDEX_FILE_NAME);
+	// Forwarded as is to the backend
+	if (proxy_request_start(&d->proxy, parser, d->url, length))
+		return 0;
 
-	if (length + extra_len > sizeof(d->url)) {
-		xlog("Error while handling url, it's length is %u and the max length is %u", length + extra_len, sizeof(d->url));
-		error_internal(d, STR_WITH_LEN("url too long\n"));
-		return -1;
-	}
+	if (d->url[length-1] == '/') {
+		size_t extra_len = strlen(INDEX_FILE_NAME);
 
-	memcpy(d->url, at, length);
-	if (extra_len) {
-		memcpy(d->url + length, INDEX_FILE_NAME, strlen(INDEX_FILE_NAME));
+		if (length + extra_len >= sizeof(d->url)) {
+			xlog("Error while handling url, it's length is %zu and the max length is %zu", length + extra_len, sizeof(d->url) - 1);
+			error_internal(d, STR_WITH_LEN("url too long\n"));
+			return -1;
+		}
+
+		memcpy(d->url + length, INDEX_FILE_NAME, extra_len);
 		length += extra_len;
+		d->url[length] = 0;
+		d->url_len = length;
 	}
-	d->url[length] = 0;
 
 	return 0;
 }
 
+static bool header_is(const char *at, size_t length, const char *name)
+{
+	return length == strlen(name) && strncasecmp(at, name, length) == 0;
+}
+
 static int on_header_field(http_parser *parser, const char *at, size_t length)
 {
 	struct web_data *d = parser->data;
-	if (length == strlen(IF_MODIFIED_SINCE_HDR) && memcmp(at, IF_MODIFIED_SINCE_HDR, strlen(IF_MODIFIED_SINCE_HDR)) == 0) {
-		d->next_hdr_val_if_modified_since = true;
+	if (web_url_done(parser) < 0)
+		return -1;
+
+	if (d->proxy.route) {
+		proxy_request_header_field(&d->proxy, at, length);
+		return 0;
+	}
+
+	if (header_is(at, length, IF_MODIFIED_SINCE_HDR)) {
+		d->next_hdr_val = HDR_IF_MODIFIED_SINCE;
 		DEBUG("Got If-Modified-Since header");
+	} else if (header_is(at, length, UPGRADE_HDR)) {
+		d->next_hdr_val = HDR_UPGRADE;
+	} else if (header_is(at, length, HTTP2_SETTINGS_HDR)) {
+		d->next_hdr_val = HDR_HTTP2_SETTINGS;
+		d->has_http2_settings = true;
 	} else {
-		d->next_hdr_val_if_modified_since = false;
+		d->next_hdr_val = HDR_OTHER;
 	}
 	return 0;
 }
 
+/* Header values may come in several pieces, a value too long to fit is
+ * ignored.
+ */
+static bool header_value_append(char *value, size_t value_size, const char *at, size_t length)
+{
+	size_t cur_len = strlen(value);
+	if (cur_len + length > value_size - 1) {
+		value[0] = 0;
+		return false;
+	}
+
+	memcpy(value + cur_len, at, length);
+	value[cur_len + length] = 0;
+	return true;
+}
+
 static int on_header_value(http_parser *parser, const char *at, size_t length)
 {
 	struct web_data *d = parser->data;
-	if (d->next_hdr_val_if_modified_since) {
-		DEBUG("Parsing If-Modified-Since string '%.*s'", length, at);
-
-		int cur_len = strlen(d->if_modified_since);
-		if (cur_len + length > sizeof(d->if_modified_since) - 1) {
-			d->if_modified_since[0] = 0;
-			d->next_hdr_val_if_modified_since = false;
-			DEBUG("Too long if-modified-since header, ignoring it");
-		} else {
-			memcpy(d->if_modified_since + cur_len, at, length);
-			d->if_modified_since[cur_len + length] = 0;
-			DEBUG("If-Modified-Since is now %.*s", cur_len + length, d->if_modified_since);
-		}
+	if (d->proxy.route) {
+		proxy_request_header_value(&d->proxy, at, length);
+		return 0;
+	}
+
+	switch (d->next_hdr_val) {
+		case HDR_IF_MODIFIED_SINCE:
+			DEBUG("Parsing If-Modified-Since string '%.*s'", length, at);
+			if (!header_value_append(d->if_modified_since, sizeof(d->if_modified_since), at, length)) {
+				d->next_hdr_val = HDR_OTHER;
+				DEBUG("Too long if-modified-since header, ignoring it");
+			} else {
+				DEBUG("If-Modified-Since is now %s", d->if_modified_since);
+			}
+			break;
+
+		case HDR_UPGRADE:
+			if (!header_value_append(d->upgrade, sizeof(d->upgrade), at, length))
+				d->next_hdr_val = HDR_OTHER;
+			break;
+
+		case HDR_HTTP2_SETTINGS:
+			if (!header_value_append(d->http2_settings, sizeof(d->http2_settings), at, length)) {
+				d->next_hdr_val = HDR_OTHER;
+				d->has_http2_settings = false;
+			}
+			break;
+
+		case HDR_OTHER:
+			break;
+	}
+	return 0;
+}
+
+static int on_headers_complete(http_parser *parser)
+{
+	struct web_data *d = parser->data;
+	if (web_url_done(parser) < 0)
+		return -1;
+
+	if (!d->proxy.route)
+		return 0;
+
+	int ret = proxy_request_headers_done(&d->proxy, &d->conn, parser->flags & F_CHUNKED);
+	if (ret > 0)
+		error_proxy(d, ret);
+	return ret ? -1 : 0;
+}
+
+/* Only a proxied request has a use for the body, it is streamed to the backend
+ * as it arrives.
+ */
+static int on_body(http_parser *parser, const char *at, size_t length)
+{
+	struct web_data *d = parser->data;
+	if (!d->proxy.route)
+		return 0;
+
+	if (!proxy_request_body(&d->proxy, at, length)) {
+		error_proxy(d, 502);
+		return -1;
 	}
 	return 0;
 }
 
 static const struct http_parser_settings parser_settings = {
+	.on_message_begin = on_message_begin,
 	.on_message_complete = on_message_complete,
 	.on_url = on_url,
 	.on_header_field = on_header_field,
 	.on_header_value = on_header_value,
+	.on_headers_complete = on_headers_complete,
+	.on_body = on_body,
 };
 
-static void web_run(void *arg)
+static void web_serve_h2c(http_parser *parser, const char *data, int len)
 {
-	struct web_data d = {
-		.fd = (long int)arg,
+	static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	struct web_data *d = parser->data;
+
+	if (buf_write(&d->conn, switching, strlen(switching)) < 0)
+		return;
+
+	struct h2_upgrade upgrade = {
+		.settings = d->http2_settings,
+		.path = d->url,
+		.if_modified_since = d->if_modified_since,
+		.head = parser->method == HTTP_HEAD,
 	};
+	h2_serve_upgrade(&d->conn, &upgrade, data, len, &draining);
+}
+
+static void web_serve(int fd, bool tls)
+{
+	struct web_data d = {};
 	http_parser parser;
 	wire_timer_t timer;
 
-	wire_fd_mode_init(&d.fd_state, d.fd);
+	active_conns++;
 
-	set_nonblock(d.fd);
+	conn_init(&d.conn, fd);
+	trace_accept(&d.conn.trace, fd);
+
+	if (tls && !conn_tls_handshake(&d.conn, 10*1000))
+		goto out;
+
+	if (tls && tls_alpn_h2(d.conn.ssl)) {
+		h2_serve(&d.conn, NULL, 0, &draining);
+		goto out;
+	}
 
 	http_parser_init(&parser, HTTP_REQUEST);
 	parser.data = &d;
@@ -413,50 +595,86 @@ static void web_run(void *arg)
 	char buf[4096];
 	bool bail_out = false;
 	bool timer_stopped = true;
+	bool first_read = true;
 	do {
-		if (timer_stopped) {
-			timer_start(&timer, 10*1000);
-			timer_stopped = false;
-		}
+		/* The request is usually there already (deferred accept or keep-alive
+		 * pipelining), only arm the timer when we need to wait for it.
+		 */
 		buf[0] = 0;
-		int received = read(d.fd, buf, sizeof(buf));
+		int received = conn_read(&d.conn, buf, sizeof(buf));
 		DEBUG("Received: %d %d", received, errno);
 		if (received == 0) {
 			/* Fall-through, tell parser about EOF */
 			DEBUG("Received EOF");
 		} else if (received < 0) {
-			if (errno == EINTR || errno == EAGAIN) {
+			if (draining && !d.in_message && (errno == EINTR || errno == EAGAIN)) {
+				// A draining server doesn't wait for the next request
+				DEBUG("Draining, not waiting for another request on socket %d", d.conn.fd);
+				bail_out = true;
+			} else if (errno == EINTR || errno == EAGAIN) {
 				DEBUG("Waiting");
+				if (timer_stopped) {
+					if (!timer_start(&timer, 10*1000))
+						break;
+					timer_stopped = false;
+				}
+
 				/* Nothing received yet, wait for it */
-				wire_fd_mode_read(&d.fd_state);
+				if (d.conn.want_write)
+					wire_fd_mode_write(&d.conn.fd_state);
+				else
+					wire_fd_mode_read(&d.conn.fd_state);
 
 				wire_wait_list_t wait_list;
 				wire_wait_list_init(&wait_list);
-				wire_fd_wait_list_chain(&wait_list, &d.fd_state);
+				wire_fd_wait_list_chain(&wait_list, &d.conn.fd_state);
 				timer_list_chain(&timer, &wait_list);
+				if (!d.in_message)
+					conn_idle_chain(&d.conn, &wait_list);
 				wire_list_wait(&wait_list);
+				if (!d.in_message)
+					conn_idle_done(&d.conn);
 
 				DEBUG("Done waiting");
 				if (!timer_triggered(&timer))
 					continue;
+
+				DEBUG("Timed out waiting for a request on socket %d", d.conn.fd);
+				bail_out = true;
 			} else {
-				DEBUG("Error receiving from socket %d: %m", d.fd);
+				DEBUG("Error receiving from socket %d: %m", d.conn.fd);
 				bail_out = true;
 			}
 		}
 
-		timer_stop(&timer);
-		timer_stopped = true;
-		wire_fd_mode_none(&d.fd_state);
+		if (!timer_stopped) {
+			timer_stop(&timer);
+			timer_stopped = true;
+			wire_fd_mode_none(&d.conn.fd_state);
+		}
 
 		if (bail_out)
 			break;
 
+		if (received > 0)
+			trace_mark(&d.conn.trace, TRACE_FIRST_READ);
+
+		if (first_read) {
+			first_read = false;
+			if (h2_supported() && h2_is_preface(buf, received)) {
+				// HTTP/2 with prior knowledge
+				h2_serve(&d.conn, buf, received, &draining);
+				break;
+			}
+		}
+
 		DEBUG("Processing %d", (int)received);
 		size_t processed = http_parser_execute(&parser, &parser_settings, buf, received);
 		if (parser.upgrade) {
-			/* Upgrade not supported yet */
-			xlog("Upgrade no supported, bailing out");
+			if (web_upgrade_h2c(&parser))
+				web_serve_h2c(&parser, buf + processed, received - processed);
+			else
+				xlog("Upgrade no supported, bailing out");
 			break;
 		} else if (received == 0) {
 			// At EOF, exit now
@@ -466,42 +684,57 @@ static void web_run(void *arg)
 			// Error in parsing
 			xlog("Not everything was parsed, error is likely, bailing out.");
 			break;
-		} else if (d.should_close) {
+		} else if (d.should_close || draining) {
 			DEBUG("Closing as requested");
 			break;
 		}
 	} while (1);
 
-	close(d.fd);
-	DEBUG("Disconnected %d", d.fd);
+out:
+	proxy_request_abort(&d.proxy);
+	conn_close(&d.conn);
+	active_conns--;
+	if (draining && active_conns == 0)
+		wire_wait_resume(&drained);
+	DEBUG("Disconnected %d", fd);
 }
 
-static void accept_run(void *arg)
+static void web_run(void *arg)
 {
-	UNUSED(arg);
-	int port = 9090;
-	int fd = socket_setup(port);
-	if (fd < 0)
-		return;
+	web_serve((long int)arg, false);
+}
 
-	xlog("Listening on port %d", port);
+static void web_run_tls(void *arg)
+{
+	web_serve((long int)arg, true);
+}
+
+static void accept_run(void *arg)
+{
+	struct listener *listener = arg;
+	int fd = listener->fd;
 
 	wire_fd_state_t fd_state;
 	wire_fd_mode_init(&fd_state, fd);
 	wire_fd_mode_read(&fd_state);
 
+	wire_wait_list_t wait_list;
+	wire_wait_list_init(&wait_list);
+	wire_fd_wait_list_chain(&wait_list, &fd_state);
+	wire_wait_chain(&wait_list, &listener->stop);
+
 	/* To be as fast as possible we want to accept all pending connections
 	 * without waiting in between, the throttling will happen by either there
 	 * being no more pending listeners to accept or by the wire pool blocking
 	 * when it is exhausted.
 	 */
-	while (1) {
+	while (!draining) {
 		int new_fd = accept(fd, NULL, NULL);
 		if (new_fd >= 0) {
 			DEBUG("New connection: %d", new_fd);
 			char name[32];
 			snprintf(name, sizeof(name), "web %d", new_fd);
-			wire_t *task = wire_pool_alloc_block(&web_pool, name, web_run, (void*)(long int)new_fd);
+			wire_t *task = wire_pool_alloc_block(&web_pool, name, listener->tls ? web_run_tls : web_run, (void*)(long int)new_fd);
 			if (!task) {
 				xlog("Web server is busy, sorry");
 				close(new_fd);
@@ -509,24 +742,287 @@ static void accept_run(void *arg)
 		} else {
 			if (errno == EINTR || errno == EAGAIN) {
 				/* Wait for the next connection */
-				wire_fd_wait(&fd_state);
+				wire_list_wait(&wait_list);
+				wire_wait_reset(&fd_state.wait);
 			} else {
 				xlog("Error accepting from listening socket: %m");
 				break;
 			}
 		}
 	}
+
+	wire_fd_mode_none(&fd_state);
+	close(fd);
+	xlog("Stopped accepting new connections on socket %d", fd);
+}
+
+/* Don't wake up for a connection until its first data arrives, with Fast Open
+ * it can even come with the SYN. Connections that never send anything are
+ * then never accepted and don't take a wire.
+ */
+static void listener_tune(int fd)
+{
+	int val = DEFER_ACCEPT_SECS;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &val, sizeof(val)) < 0)
+		xlog("Failed to set TCP_DEFER_ACCEPT on socket %d: %m", fd);
+
+	val = FASTOPEN_QUEUE_LEN;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &val, sizeof(val)) < 0)
+		xlog("Failed to enable TCP_FASTOPEN on socket %d: %m", fd);
+}
+
+static void listener_start(struct listener *listener, int fd, bool tls)
+{
+	listener_tune(fd);
+	listener->fd = fd;
+	listener->tls = tls;
+	wire_wait_init(&listener->stop);
+	wire_init(&listener->wire, tls ? "accept tls" : "accept", accept_run, listener, WIRE_STACK_ALLOC(4096));
+}
+
+static void drain(void)
+{
+	xlog("Draining %d active connections, %d blocked on write", active_conns, conn_blocked_writers());
+	wire_wait_init(&drained);
+	draining = true;
+	wire_wait_resume(&listener_http.stop);
+	if (listener_https.fd >= 0)
+		wire_wait_resume(&listener_https.stop);
+
+	// The connections waiting for a request close now, the others after it
+	conn_stop_shaping();
+	conn_idle_wake();
+
+	wire_timer_t timer;
+	if (active_conns > 0 && timer_start(&timer, DRAIN_TIMEOUT_MSECS)) {
+		wire_wait_list_t wait_list;
+		wire_wait_list_init(&wait_list);
+		wire_wait_chain(&wait_list, &drained);
+		timer_list_chain(&timer, &wait_list);
+		wire_list_wait(&wait_list);
+		timer_stop(&timer);
+	}
+
+	if (active_conns > 0)
+		xlog("Drain timed out with %d connections still active", active_conns);
+
+	cache_shutdown();
+	exit(0);
+}
+
+static void control_signals_block(void)
+{
+	sigset_t sig_set;
+	sigemptyset(&sig_set);
+	sigaddset(&sig_set, SIGTERM);
+	sigaddset(&sig_set, SIGINT);
+
+	if (pthread_sigmask(SIG_BLOCK, &sig_set, NULL) < 0)
+		xlog("Failed to block signals: %m");
+}
+
+static int control_signals_setup(void)
+{
+	sigset_t sig_set;
+	sigemptyset(&sig_set);
+	sigaddset(&sig_set, SIGTERM);
+	sigaddset(&sig_set, SIGINT);
+
+	int fd = signalfd(-1, &sig_set, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (fd < 0)
+		xlog("Failed to create a signalfd: %m");
+	return fd;
+}
+
+/* Waits for a termination signal or for a new binary to take over, in both
+ * cases the connections are drained before exiting.
+ */
+static void control_run(void *arg)
+{
+	UNUSED(arg);
+
+	int sfd = control_signals_setup();
+	if (sfd < 0)
+		return;
+
+	wire_wait_list_t wait_list;
+	wire_wait_list_init(&wait_list);
+
+	wire_fd_state_t sfd_state;
+	wire_fd_mode_init(&sfd_state, sfd);
+	wire_fd_mode_read(&sfd_state);
+	wire_fd_wait_list_chain(&wait_list, &sfd_state);
+
+	wire_fd_state_t ufd_state;
+	if (upgrade_fd >= 0) {
+		wire_fd_mode_init(&ufd_state, upgrade_fd);
+		wire_fd_mode_read(&ufd_state);
+		wire_fd_wait_list_chain(&wait_list, &ufd_state);
+	}
+
+	while (1) {
+		wire_list_wait(&wait_list);
+
+		if (sfd_state.wait.triggered) {
+			wire_wait_reset(&sfd_state.wait);
+
+			struct signalfd_siginfo siginfo;
+			int ret = read(sfd, &siginfo, sizeof(siginfo));
+			if (ret == sizeof(siginfo)) {
+				xlog("Terminating by signal %d", siginfo.ssi_signo);
+				break;
+			}
+		}
+
+		if (upgrade_fd >= 0 && ufd_state.wait.triggered) {
+			wire_wait_reset(&ufd_state.wait);
+
+			int cfd = upgrade_accept(upgrade_fd);
+			if (cfd < 0)
+				continue;
+
+			// Let the new server bind the upgrade socket
+			wire_fd_mode_none(&ufd_state);
+			close(upgrade_fd);
+			upgrade_fd = -1;
+
+			if (upgrade_send(cfd, &server_fds))
+				break;
+			xlog("Upgrade failed, continuing to serve");
+		}
+	}
+
+	wire_fd_mode_none(&sfd_state);
+	close(sfd);
+
+	drain();
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-w workers] [-H] [-u] [-c cert -k key] [-p prefix=host:port]... [-r rate] [-s dir]\n"
+	                "  -w workers  Number of worker processes sharing the cache (default 1)\n"
+	                "  -H          Back the cache with huge pages\n"
+	                "  -u          Take over the listening socket and cache of a running server\n"
+	                "  -c cert     Certificate chain file (PEM) to serve HTTPS on port %d\n"
+	                "  -k key      Private key file (PEM) of the certificate\n"
+	                "  -p route    Forward the URLs starting with prefix to the backend at host:port\n"
+	                "  -r rate     Limit the sending rate of each connection, in KB/s\n"
+	                "  -s dir      Directory for the hot-set and traces (default /var/tmp/wire-httpd-<uid>)\n",
+	                name, TLS_PORT);
 }
 
-int main()
+int main(int argc, char **argv)
 {
+	int num_workers = 1;
+	bool huge_pages = false;
+	bool upgrade = false;
+	const char *cert_file = NULL;
+	const char *key_file = NULL;
+	const char *rate = NULL;
+	const char *state_dir = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:Huc:k:p:r:s:")) != -1) {
+		switch (opt) {
+			case 'w': num_workers = atoi(optarg); break;
+			case 'H': huge_pages = true; break;
+			case 'u': upgrade = true; break;
+			case 'c': cert_file = optarg; break;
+			case 'k': key_file = optarg; break;
+			case 'p': if (!proxy_route_add(optarg)) return 1; break;
+			case 'r': rate = optarg; break;
+			case 's': state_dir = optarg; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+
+	if (num_workers < 1 || num_workers > MAX_WORKERS) {
+		fprintf(stderr, "Number of workers must be between 1 and %d\n", MAX_WORKERS);
+		return 1;
+	}
+
+	if (rate) {
+		char *end;
+		long rate_kb = strtol(rate, &end, 10);
+		if (*end || rate_kb < 1 || rate_kb > MAX_RATE_KB) {
+			fprintf(stderr, "Rate must be between 1 and %d KB/s\n", MAX_RATE_KB);
+			return 1;
+		}
+		conn_set_rate_limit(rate_kb * 1024);
+	}
+
+	if (!cert_file != !key_file) {
+		fprintf(stderr, "Both a certificate and a key are needed for HTTPS\n");
+		return 1;
+	}
+
+	if (cert_file && !tls_init(cert_file, key_file))
+		return 1;
+
+	// Only a directory asked for is required, without one nothing is kept
+	if (!state_init(state_dir) && state_dir)
+		return 1;
+
+	control_signals_block();
+	trace_init();
+
+	if (upgrade) {
+		if (!upgrade_receive(PORT, &server_fds))
+			return 1;
+	}
+
+	// The cache and the listening sockets are created before the workers are
+	// forked so that they are shared by all of them
+	cache_init(huge_pages, server_fds.cache_fd);
+	server_fds.cache_fd = cache_fd();
+
+	if (server_fds.listen_fd < 0) {
+		server_fds.listen_fd = socket_setup(PORT);
+		if (server_fds.listen_fd < 0)
+			return 1;
+	}
+
+	xlog("Listening on port %d", PORT);
+
+	if (cert_file) {
+		if (server_fds.tls_listen_fd < 0) {
+			server_fds.tls_listen_fd = socket_setup(TLS_PORT);
+			if (server_fds.tls_listen_fd < 0)
+				return 1;
+		}
+		xlog("Listening for HTTPS on port %d", TLS_PORT);
+	} else if (server_fds.tls_listen_fd >= 0) {
+		// The old server had HTTPS but we weren't asked for it
+		close(server_fds.tls_listen_fd);
+		server_fds.tls_listen_fd = -1;
+	}
+
+	upgrade_fd = upgrade_listen(PORT);
+
+	int worker = 0;
+	if (num_workers > 1) {
+		worker = prefork(num_workers, &server_fds, upgrade_fd);
+		// Upgrades are handled by the supervisor
+		close(upgrade_fd);
+		upgrade_fd = -1;
+	} else {
+		cache_owner_alloc();
+	}
+
 	wire_thread_init(&wire_thread_main);
 	wire_stack_fault_detector_install();
 	wire_fd_init();
 	wire_io_init(32);
 	wire_pool_init(&web_pool, NULL, WEB_POOL_SIZE, DATA_BUF_SIZE + WIRE_DATA_SIZE);
-	cache_init();
-	wire_init(&wire_accept, "accept", accept_run, NULL, WIRE_STACK_ALLOC(4096));
+	cache_start(worker == 0);
+	trace_start();
+	conn_start();
+	listener_start(&listener_http, server_fds.listen_fd, false);
+	listener_https.fd = -1;
+	if (server_fds.tls_listen_fd >= 0)
+		listener_start(&listener_https, server_fds.tls_listen_fd, true);
+	wire_init(&wire_control, "control", control_run, NULL, WIRE_STACK_ALLOC(8192));
 	wire_thread_run();
 	return 0;
 }
@@ -0,0 +1,25 @@
+#include "mime.h"
+#include "gperf.h"
+
+#include <stddef.h>
+
+const char *content_type_from_filename(const char *filename)
+{
+	const char *last_dot = NULL;
+	int len = 0;
+
+	for (; *filename; filename++, len++) {
+		switch (*filename) {
+			case '.': last_dot = filename; len = 0; break;
+			case '/': last_dot = NULL; break;
+		}
+	}
+
+	if (last_dot == NULL)
+		return "text/plain";
+
+	const char *suffix = mime_from_suffix_name(last_dot+1, len-1);
+	if (suffix)
+		return suffix;
+	return "application/binary";
+}
@@ -0,0 +1 @@
+const char *content_type_from_filename(const char *filename);
@@ -0,0 +1,205 @@
+#include "prefork.h"
+#include "upgrade.h"
+#include "cache.h"
+#include "xlog.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+
+/* The supervisor process only forks the workers, restarts them when they die,
+ * passes the signals along and hands the server over to a new binary on
+ * upgrade. All the real work happens in the workers.
+ */
+
+struct worker {
+	pid_t pid;
+	time_t start_time;
+	int cache_owner; // Taken before the fork so the worker never runs without it
+};
+
+static struct worker workers[MAX_WORKERS];
+
+static int worker_find(pid_t pid)
+{
+	int i;
+	for (i = 0; i < MAX_WORKERS; i++) {
+		if (workers[i].pid == pid)
+			return i;
+	}
+	return -1;
+}
+
+static pid_t worker_spawn(int id)
+{
+	workers[id].cache_owner = cache_owner_alloc();
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		xlog("Failed to fork worker %d: %m", id);
+		cache_owner_reclaim(workers[id].cache_owner);
+		return -1;
+	}
+
+	if (pid > 0) {
+		workers[id].pid = pid;
+		workers[id].start_time = time(NULL);
+	}
+	return pid;
+}
+
+static void workers_signal(int num_workers, int signo)
+{
+	int i;
+	for (i = 0; i < num_workers; i++) {
+		if (workers[i].pid > 0)
+			kill(workers[i].pid, signo);
+	}
+}
+
+static void workers_terminate(int num_workers, bool *terminating)
+{
+	xlog("Terminating the workers");
+	*terminating = true;
+	workers_signal(num_workers, SIGTERM);
+}
+
+/* Forks the worker processes, returns the worker id in each of the workers
+ * and never returns in the supervisor.
+ */
+int prefork(int num_workers, struct upgrade_fds *fds, int upgrade_fd)
+{
+	sigset_t sig_set;
+	sigemptyset(&sig_set);
+	sigaddset(&sig_set, SIGCHLD);
+	sigaddset(&sig_set, SIGTERM);
+	sigaddset(&sig_set, SIGINT);
+	sigaddset(&sig_set, SIGUSR1);
+	sigaddset(&sig_set, SIGUSR2);
+
+	if (pthread_sigmask(SIG_BLOCK, &sig_set, NULL) < 0)
+		xlog("Failed to block signals: %m");
+
+	int sfd = signalfd(-1, &sig_set, SFD_CLOEXEC);
+	if (sfd < 0) {
+		xlog("Failed to create a signalfd: %m");
+		exit(1);
+	}
+
+	int id;
+	int num_alive = 0;
+	for (id = 0; id < num_workers; id++) {
+		pid_t pid = worker_spawn(id);
+		if (pid == 0) {
+			close(sfd);
+			return id;
+		} else if (pid > 0) {
+			num_alive++;
+		}
+	}
+
+	xlog("Started %d workers", num_alive);
+
+	bool terminating = false;
+	while (1) {
+		struct pollfd pfd[2] = {
+			{ .fd = sfd, .events = POLLIN },
+			{ .fd = upgrade_fd, .events = POLLIN },
+		};
+		int ret = poll(pfd, upgrade_fd >= 0 ? 2 : 1, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			xlog("Error polling in the supervisor: %m");
+			exit(1);
+		}
+
+		if (upgrade_fd >= 0 && (pfd[1].revents & POLLIN)) {
+			int cfd = upgrade_accept(upgrade_fd);
+			if (cfd >= 0) {
+				// Let the new server bind the upgrade socket
+				close(upgrade_fd);
+				upgrade_fd = -1;
+
+				// The workers drain their connections on SIGTERM
+				if (upgrade_send(cfd, fds))
+					workers_terminate(num_workers, &terminating);
+				else
+					xlog("Upgrade failed, continuing to serve");
+			}
+		}
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		struct signalfd_siginfo siginfo;
+		ret = read(sfd, &siginfo, sizeof(siginfo));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			xlog("Error reading from signalfd: %m");
+			exit(1);
+		}
+
+		switch (siginfo.ssi_signo) {
+			case SIGCHLD:
+				{
+					pid_t pid;
+					int status;
+					while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+						id = worker_find(pid);
+						if (id < 0)
+							continue;
+						workers[id].pid = 0;
+						num_alive--;
+
+						// Whatever it held in the cache is not coming back
+						cache_owner_reclaim(workers[id].cache_owner);
+						workers[id].cache_owner = -1;
+
+						if (terminating)
+							continue;
+
+						xlog("Worker %d (pid %d) exited with status %d, restarting it", id, pid, status);
+						// Don't spin if the worker dies right away
+						if (time(NULL) - workers[id].start_time < 1)
+							sleep(1);
+						pid = worker_spawn(id);
+						if (pid == 0) {
+							close(sfd);
+							return id;
+						} else if (pid > 0) {
+							num_alive++;
+						}
+					}
+					if (terminating && num_alive == 0) {
+						xlog("All workers exited");
+						exit(0);
+					}
+				}
+				break;
+
+			case SIGTERM:
+			case SIGINT:
+				workers_terminate(num_workers, &terminating);
+				break;
+
+			case SIGUSR2:
+				// Every worker dumps its own request traces
+				workers_signal(num_workers, SIGUSR2);
+				break;
+
+			default:
+				// The cache refresh is handled by the master worker
+				if (workers[0].pid > 0)
+					kill(workers[0].pid, siginfo.ssi_signo);
+				break;
+		}
+	}
+}
@@ -0,0 +1,5 @@
+#define MAX_WORKERS 64
+
+struct upgrade_fds;
+
+int prefork(int num_workers, struct upgrade_fds *fds, int upgrade_fd);
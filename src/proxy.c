@@ -0,0 +1,893 @@
+#include "proxy.h"
+#include "conn.h"
+#include "timer.h"
+#include "xlog.h"
+
+#include "wire_wait.h"
+#include "macros.h"
+#include "http_parser.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define PROXY_MAX_ROUTES 8
+#define PROXY_MAX_CONNS 32 // Per route and process, more requests wait for a free one
+#define PROXY_BUF_SIZE 16*1024
+#define PROXY_SPLICE_SIZE 64*1024
+#define PROXY_ACQUIRE_TIMEOUT_MSECS 5*1000
+#define PROXY_CONNECT_TIMEOUT_MSECS 5*1000
+#define PROXY_READ_TIMEOUT_MSECS 60*1000
+
+#define STR_WITH_LEN(s) s, strlen(s)
+
+// A backend connection slot, the connection stays open between requests
+struct upstream {
+	struct conn conn; // fd is -1 when not connected
+	bool in_use;
+	int pipe_fds[2]; // For splicing the responses, created on first use
+};
+
+struct proxy_waiter {
+	struct list_head list;
+	wire_wait_t wait;
+};
+
+struct proxy_route {
+	char prefix[128];
+	size_t prefix_len;
+	char backend[128];
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	struct upstream conns[PROXY_MAX_CONNS];
+	struct list_head waiters;
+};
+
+static struct proxy_route routes[PROXY_MAX_ROUTES];
+static int num_routes;
+
+// Headers that only make sense on the client connection
+static const char *hop_by_hop_headers[] = {
+	"Connection",
+	"Keep-Alive",
+	"Proxy-Connection",
+	"TE",
+	"Trailer",
+	"Transfer-Encoding",
+	"Upgrade",
+	"HTTP2-Settings",
+	"Expect",
+};
+
+#define NUM_HOP_BY_HOP_HEADERS (sizeof(hop_by_hop_headers) / sizeof(hop_by_hop_headers[0]))
+
+/* The spec is PREFIX=HOST:PORT, e.g. /api/=127.0.0.1:8080, the backend address
+ * is resolved once here.
+ */
+bool proxy_route_add(const char *spec)
+{
+	const char *eq = strchr(spec, '=');
+	const char *colon = eq ? strrchr(eq, ':') : NULL;
+
+	if (!eq || eq == spec || spec[0] != '/' || !colon || colon[1] == 0) {
+		xlog("Invalid proxy route '%s', expected PREFIX=HOST:PORT", spec);
+		return false;
+	}
+
+	if (num_routes == PROXY_MAX_ROUTES) {
+		xlog("Too many proxy routes, at most %d are supported", PROXY_MAX_ROUTES);
+		return false;
+	}
+
+	struct proxy_route *route = &routes[num_routes];
+	size_t prefix_len = eq - spec;
+	if (prefix_len >= sizeof(route->prefix) || strlen(eq + 1) >= sizeof(route->backend)) {
+		xlog("Proxy route '%s' is too long", spec);
+		return false;
+	}
+
+	memcpy(route->prefix, spec, prefix_len);
+	route->prefix[prefix_len] = 0;
+	route->prefix_len = prefix_len;
+	strcpy(route->backend, eq + 1);
+
+	// An IPv6 address is given in brackets
+	char host[128];
+	const char *host_start = eq + 1;
+	size_t host_len = colon - host_start;
+	if (host_len >= 2 && host_start[0] == '[' && host_start[host_len-1] == ']') {
+		host_start++;
+		host_len -= 2;
+	}
+	memcpy(host, host_start, host_len);
+	host[host_len] = 0;
+
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo *res;
+	int ret = getaddrinfo(host, colon + 1, &hints, &res);
+	if (ret != 0) {
+		xlog("Failed to resolve backend %s: %s", route->backend, gai_strerror(ret));
+		return false;
+	}
+	memcpy(&route->addr, res->ai_addr, res->ai_addrlen);
+	route->addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	int i;
+	for (i = 0; i < PROXY_MAX_CONNS; i++) {
+		struct upstream *up = &route->conns[i];
+		up->conn.fd = -1;
+		up->pipe_fds[0] = -1;
+		up->pipe_fds[1] = -1;
+	}
+	list_head_init(&route->waiters);
+
+	num_routes++;
+	xlog("Proxying %s to %s", route->prefix, route->backend);
+	return true;
+}
+
+static struct proxy_route *route_find(const char *url, size_t len)
+{
+	int i;
+	for (i = 0; i < num_routes; i++) {
+		struct proxy_route *route = &routes[i];
+		if (len >= route->prefix_len && memcmp(url, route->prefix, route->prefix_len) == 0)
+			return route;
+	}
+	return NULL;
+}
+
+bool proxy_match(const char *url, size_t len)
+{
+	return route_find(url, len) != NULL;
+}
+
+static void upstream_close(struct upstream *up)
+{
+	if (up->conn.fd >= 0) {
+		conn_close(&up->conn);
+		up->conn.fd = -1;
+	}
+	if (up->pipe_fds[0] >= 0) {
+		close(up->pipe_fds[0]);
+		close(up->pipe_fds[1]);
+		up->pipe_fds[0] = -1;
+		up->pipe_fds[1] = -1;
+	}
+}
+
+/* Take a free slot, preferably one with an open connection, or wait a while
+ * for another request to finish with one. NULL if none came free in time.
+ */
+static struct upstream *upstream_acquire(struct proxy_route *route)
+{
+	wire_timer_t timer;
+	bool timer_started = false;
+
+	while (1) {
+		struct upstream *found = NULL;
+		int i;
+
+		for (i = 0; i < PROXY_MAX_CONNS; i++) {
+			struct upstream *up = &route->conns[i];
+			if (up->in_use)
+				continue;
+			if (up->conn.fd >= 0) {
+				found = up;
+				break;
+			}
+			if (!found)
+				found = up;
+		}
+
+		if (found) {
+			if (timer_started)
+				timer_stop(&timer);
+			found->in_use = true;
+			return found;
+		}
+
+		if (!timer_started) {
+			if (!timer_start(&timer, PROXY_ACQUIRE_TIMEOUT_MSECS))
+				return NULL;
+			timer_started = true;
+		}
+
+		struct proxy_waiter waiter;
+		wire_wait_init(&waiter.wait);
+		list_add_tail(&waiter.list, &route->waiters);
+		DEBUG("All connections to %s are busy, waiting", route->backend);
+
+		wire_wait_list_t wait_list;
+		wire_wait_list_init(&wait_list);
+		wire_wait_chain(&wait_list, &waiter.wait);
+		timer_list_chain(&timer, &wait_list);
+		wire_list_wait(&wait_list);
+
+		// A released slot takes us off the list, try it even if the time is up
+		if (waiter.wait.triggered)
+			continue;
+		list_del(&waiter.list);
+
+		if (timer_triggered(&timer)) {
+			timer_stop(&timer);
+			xlog("All connections to backend %s stayed busy, giving up", route->backend);
+			return NULL;
+		}
+	}
+}
+
+static void upstream_release(struct proxy_route *route, struct upstream *up, bool reuse)
+{
+	if (!reuse)
+		upstream_close(up);
+	up->in_use = false;
+
+	struct list_head *head = list_head(&route->waiters);
+	if (head) {
+		struct proxy_waiter *waiter = list_entry(head, struct proxy_waiter, list);
+		wire_wait_resume(&waiter->wait);
+		list_del(head);
+	}
+}
+
+static bool upstream_wait(struct upstream *up, bool write, int timeout_msecs)
+{
+	wire_timer_t timer;
+
+	if (!timer_start(&timer, timeout_msecs))
+		return false;
+
+	if (write)
+		wire_fd_mode_write(&up->conn.fd_state);
+	else
+		wire_fd_mode_read(&up->conn.fd_state);
+
+	wire_wait_list_t wait_list;
+	wire_wait_list_init(&wait_list);
+	wire_fd_wait_list_chain(&wait_list, &up->conn.fd_state);
+	timer_list_chain(&timer, &wait_list);
+	wire_list_wait(&wait_list);
+	wire_fd_mode_none(&up->conn.fd_state);
+
+	bool timed_out = timer_triggered(&timer);
+	timer_stop(&timer);
+	return !timed_out;
+}
+
+/* An idle keep-alive connection has nothing to read, EOF or stray data mean
+ * the backend is done with it.
+ */
+static bool upstream_alive(struct upstream *up)
+{
+	char c;
+	int ret = recv(up->conn.fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+	return ret < 0 && errno == EAGAIN;
+}
+
+static bool upstream_connect(struct proxy_route *route, struct upstream *up)
+{
+	int fd = socket(route->addr.ss_family, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		xlog("Failed to create a socket for backend %s: %m", route->backend);
+		return false;
+	}
+
+	conn_init(&up->conn, fd);
+	up->conn.rate_limit = 0; // Only the clients are shaped
+
+	// The request heads are small, don't hold them back waiting for ACKs
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(fd, (struct sockaddr *)&route->addr, route->addr_len) < 0) {
+		if (errno != EINPROGRESS)
+			goto err;
+
+		if (!upstream_wait(up, true, PROXY_CONNECT_TIMEOUT_MSECS)) {
+			errno = ETIMEDOUT;
+			goto err;
+		}
+
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+			goto err;
+		if (err) {
+			errno = err;
+			goto err;
+		}
+	}
+
+	DEBUG("Connected to backend %s on socket %d", route->backend, fd);
+	return true;
+
+err:
+	xlog("Failed to connect to backend %s: %m", route->backend);
+	upstream_close(up);
+	return false;
+}
+
+static void head_append(struct proxy_req *req, const char *data, size_t len)
+{
+	if (req->overflow || req->head_len + len > PROXY_HEAD_SIZE) {
+		req->overflow = true;
+		return;
+	}
+
+	memcpy(req->head + req->head_len, data, len);
+	req->head_len += len;
+}
+
+static bool header_is(const char *at, size_t length, const char *name)
+{
+	return length == strlen(name) && strncasecmp(at, name, length) == 0;
+}
+
+static bool header_hop_by_hop(const char *name, size_t len)
+{
+	unsigned i;
+	for (i = 0; i < NUM_HOP_BY_HOP_HEADERS; i++) {
+		if (header_is(name, len, hop_by_hop_headers[i]))
+			return true;
+	}
+	return false;
+}
+
+static void connection_append(struct proxy_req *req, const char *data, size_t len)
+{
+	if (len > (size_t)(PROXY_CONNECTION_SIZE - req->connection_len))
+		len = PROXY_CONNECTION_SIZE - req->connection_len;
+	memcpy(req->connection + req->connection_len, data, len);
+	req->connection_len += len;
+}
+
+// The Connection value is a comma separated list of header names
+static bool connection_lists(const struct proxy_req *req, const char *name, size_t len)
+{
+	const char *p = req->connection;
+	const char *end = req->connection + req->connection_len;
+
+	while (p < end) {
+		while (p < end && (*p == ',' || *p == ' ' || *p == '\t'))
+			p++;
+		const char *token = p;
+		while (p < end && *p != ',' && *p != ' ' && *p != '\t')
+			p++;
+		if ((size_t)(p - token) == len && strncasecmp(token, name, len) == 0)
+			return true;
+	}
+	return false;
+}
+
+static void head_field(struct proxy_req *req, const char *at, size_t len)
+{
+	if (req->in_value) {
+		// The previous header is complete
+		if (!req->skip_value)
+			head_append(req, "\r\n", 2);
+		req->in_value = false;
+		req->skip_value = false;
+		req->connection_value = false;
+		req->line_start = req->head_len;
+	}
+
+	head_append(req, at, len);
+}
+
+static void head_value(struct proxy_req *req, const char *at, size_t len)
+{
+	if (!req->in_value) {
+		// The name is complete, drop it again if it isn't to be forwarded
+		const char *name = req->head + req->line_start;
+		size_t name_len = req->head_len - req->line_start;
+
+		req->in_value = true;
+		req->skip_value = header_hop_by_hop(name, name_len);
+		req->connection_value = header_is(name, name_len, "Connection");
+		if (req->connection_value && req->connection_len)
+			connection_append(req, ",", 1);
+
+		if (req->skip_value)
+			req->head_len = req->line_start;
+		else
+			head_append(req, ": ", 2);
+	}
+
+	if (req->connection_value)
+		connection_append(req, at, len);
+	if (!req->skip_value)
+		head_append(req, at, len);
+}
+
+/* Ends the last header and drops the ones named in Connection, they may have
+ * come before it.
+ */
+static void head_headers_done(struct proxy_req *req)
+{
+	if (req->in_value && !req->skip_value)
+		head_append(req, "\r\n", 2);
+	req->in_value = false;
+
+	if (req->overflow || !req->connection_len)
+		return;
+
+	// Past the request or status line
+	char *end = req->head + req->head_len;
+	char *line = memchr(req->head, '\n', req->head_len);
+	if (!line)
+		return;
+	line++;
+
+	while (line < end) {
+		char *next = memchr(line, '\n', end - line);
+		next = next ? next + 1 : end;
+		char *colon = memchr(line, ':', next - line);
+		if (colon && connection_lists(req, line, colon - line)) {
+			memmove(line, next, end - next);
+			end -= next - line;
+		} else {
+			line = next;
+		}
+	}
+	req->head_len = end - req->head;
+}
+
+// The parser hands over the bodies de-chunked, chunk them again as they go
+static int write_chunk(struct conn *conn, const char *at, size_t len)
+{
+	char size[24];
+	struct iovec iov[3] = {
+		{ .iov_base = size, .iov_len = snprintf(size, sizeof(size), "%zx\r\n", len) },
+		{ .iov_base = (void *)at, .iov_len = len },
+		{ .iov_base = "\r\n", .iov_len = 2 },
+	};
+	return buf_writev(conn, iov, 3);
+}
+
+/* Called with the complete URL of every request, when it is proxied the
+ * request line starts the head. The backend slot is only taken once the head
+ * is complete so that a client slow to send its headers doesn't hold one. The
+ * request keeps the HTTP version of the client so that an HTTP/1.0 client
+ * doesn't get chunked data.
+ */
+bool proxy_request_start(struct proxy_req *req, const struct http_parser *parser, const char *url, size_t len)
+{
+	memset(req, 0, offsetof(struct proxy_req, head));
+
+	struct proxy_route *route = route_find(url, len);
+	if (!route)
+		return false;
+
+	req->route = route;
+
+	char line[32];
+	int line_len = snprintf(line, sizeof(line), "%s ", http_method_str(parser->method));
+	head_append(req, line, line_len);
+	head_append(req, url, len);
+	line_len = snprintf(line, sizeof(line), " HTTP/%d.%d\r\n", parser->http_major, parser->http_minor);
+	head_append(req, line, line_len);
+	// The backend connection is pooled whether or not the client's is kept
+	if (parser->http_major == 1 && parser->http_minor == 0)
+		head_append(req, STR_WITH_LEN("Connection: keep-alive\r\n"));
+	req->line_start = req->head_len;
+	return true;
+}
+
+void proxy_request_header_field(struct proxy_req *req, const char *at, size_t len)
+{
+	head_field(req, at, len);
+}
+
+void proxy_request_header_value(struct proxy_req *req, const char *at, size_t len)
+{
+	if (!req->in_value && header_is(req->head + req->line_start, req->head_len - req->line_start, "Expect") &&
+			len >= 12 && strncasecmp(at, "100-continue", 12) == 0)
+		req->expect_continue = true;
+
+	head_value(req, at, len);
+}
+
+int proxy_request_headers_done(struct proxy_req *req, struct conn *client, bool chunked)
+{
+	head_headers_done(req);
+
+	req->chunked = chunked;
+	if (chunked)
+		head_append(req, STR_WITH_LEN("Transfer-Encoding: chunked\r\n"));
+	head_append(req, "\r\n", 2);
+
+	if (req->overflow) {
+		xlog("Request head for backend %s is over %d bytes", req->route->backend, PROXY_HEAD_SIZE);
+		proxy_request_abort(req);
+		return 431;
+	}
+
+	struct upstream *up = upstream_acquire(req->route);
+	if (!up) {
+		proxy_request_abort(req);
+		return 503;
+	}
+	req->up = up;
+
+	/* A pooled connection may have been closed by the backend meanwhile or be
+	 * closed as we write, then the head is sent again on a new connection.
+	 */
+	bool reused = up->conn.fd >= 0;
+	if (reused && !upstream_alive(up)) {
+		upstream_close(up);
+		reused = false;
+	}
+
+	while (1) {
+		if (up->conn.fd < 0 && !upstream_connect(req->route, up))
+			break;
+		if (buf_write(&up->conn, req->head, req->head_len) == 0)
+			break;
+		upstream_close(up);
+		if (!reused)
+			break;
+		reused = false;
+	}
+
+	if (up->conn.fd < 0) {
+		proxy_request_abort(req);
+		return 502;
+	}
+
+	// The client is waiting for a go ahead before sending the body
+	if (req->expect_continue) {
+		static const char go_ahead[] = "HTTP/1.1 100 Continue\r\n\r\n";
+		if (buf_write(client, go_ahead, sizeof(go_ahead) - 1) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+bool proxy_request_body(struct proxy_req *req, const char *at, size_t len)
+{
+	struct upstream *up = req->up;
+
+	if (!req->chunked)
+		return buf_write(&up->conn, at, len) == 0;
+	return write_chunk(&up->conn, at, len) == 0;
+}
+
+struct relay {
+	struct proxy_req *req; // The response head is rebuilt in the request's place
+	struct conn *client;
+	bool head;
+	bool client_keep_alive;
+	bool client_http10;
+	bool status_done;
+	bool headers_done;
+	bool chunked;
+	bool sent;
+	bool failed; // Already logged or the client is gone
+	bool complete;
+	bool keep_alive;
+	bool client_close;
+	uint64_t content_length; // ULLONG_MAX when chunked or up to EOF
+	uint64_t body_len;
+};
+
+static int relay_on_message_begin(http_parser *parser)
+{
+	struct relay *relay = parser->data;
+	struct proxy_req *req = relay->req;
+
+	// The request head went out already
+	req->overflow = false;
+	req->in_value = false;
+	req->skip_value = false;
+	req->connection_value = false;
+	req->connection_len = 0;
+	req->head_len = 0;
+	relay->status_done = false;
+	return 0;
+}
+
+static void relay_status_start(http_parser *parser)
+{
+	struct relay *relay = parser->data;
+
+	if (relay->req->head_len == 0) {
+		char line[32];
+		int line_len = snprintf(line, sizeof(line), "HTTP/%d.%d %d ", parser->http_major, parser->http_minor,
+				parser->status_code);
+		head_append(relay->req, line, line_len);
+	}
+}
+
+// The reason phrase may be missing or come in pieces
+static void relay_status_done(http_parser *parser)
+{
+	struct relay *relay = parser->data;
+
+	if (relay->status_done)
+		return;
+
+	relay_status_start(parser);
+	head_append(relay->req, "\r\n", 2);
+	relay->req->line_start = relay->req->head_len;
+	relay->status_done = true;
+}
+
+static int relay_on_status(http_parser *parser, const char *at, size_t length)
+{
+	struct relay *relay = parser->data;
+	relay_status_start(parser);
+	head_append(relay->req, at, length);
+	return 0;
+}
+
+static int relay_on_header_field(http_parser *parser, const char *at, size_t length)
+{
+	struct relay *relay = parser->data;
+	relay_status_done(parser);
+	head_field(relay->req, at, length);
+	return 0;
+}
+
+static int relay_on_header_value(http_parser *parser, const char *at, size_t length)
+{
+	struct relay *relay = parser->data;
+	head_value(relay->req, at, length);
+	return 0;
+}
+
+/* The framing of the client connection is our own, the body is chunked again
+ * if the backend chunked it and the client is told when it will be closed.
+ */
+static int relay_on_headers_complete(http_parser *parser)
+{
+	struct relay *relay = parser->data;
+	struct proxy_req *req = relay->req;
+	unsigned status = parser->status_code;
+
+	relay_status_done(parser);
+	head_headers_done(req);
+
+	relay->headers_done = true;
+	relay->content_length = parser->content_length;
+	relay->keep_alive = http_should_keep_alive(parser);
+	relay->chunked = parser->flags & F_CHUNKED;
+
+	// These have no body whatever their Content-Length says
+	bool interim = status / 100 == 1;
+	bool no_content = interim || status == 204 || status == 304;
+	bool no_body = relay->head || no_content;
+
+	if (relay->chunked && !no_content)
+		head_append(req, STR_WITH_LEN("Transfer-Encoding: chunked\r\n"));
+	// The end of a body that runs up to EOF, the client only knows it by its own EOF
+	if (!no_body && !relay->chunked && relay->content_length == ULLONG_MAX)
+		relay->client_close = true;
+	if (!interim) {
+		if (!relay->client_keep_alive || relay->client_close)
+			head_append(req, STR_WITH_LEN("Connection: close\r\n"));
+		else if (relay->client_http10)
+			head_append(req, STR_WITH_LEN("Connection: keep-alive\r\n"));
+	}
+	head_append(req, "\r\n", 2);
+
+	if (req->overflow) {
+		xlog("Response head from backend %s is over %d bytes", req->route->backend, PROXY_HEAD_SIZE);
+		relay->failed = true;
+		return -1;
+	}
+
+	relay->sent = true;
+	if (buf_write(relay->client, req->head, req->head_len) < 0) {
+		relay->failed = true;
+		return -1;
+	}
+
+	return no_body;
+}
+
+static int relay_on_body(http_parser *parser, const char *at, size_t length)
+{
+	struct relay *relay = parser->data;
+	int ret;
+
+	relay->body_len += length;
+	if (relay->chunked)
+		ret = write_chunk(relay->client, at, length);
+	else
+		ret = buf_write(relay->client, at, length);
+
+	if (ret < 0) {
+		relay->failed = true;
+		return -1;
+	}
+	return 0;
+}
+
+static int relay_on_message_complete(http_parser *parser)
+{
+	struct relay *relay = parser->data;
+	unsigned status = parser->status_code;
+
+	// An interim 1xx response is followed by the actual one
+	if (status / 100 == 1) {
+		relay->headers_done = false;
+		return 0;
+	}
+
+	if (relay->chunked && !relay->head && status != 204 && status != 304 &&
+			buf_write(relay->client, STR_WITH_LEN("0\r\n\r\n")) < 0) {
+		relay->failed = true;
+		return -1;
+	}
+
+	// Stop the parser right there, anything after it is not for this request
+	relay->complete = true;
+	return -1;
+}
+
+static const struct http_parser_settings relay_settings = {
+	.on_message_begin = relay_on_message_begin,
+	.on_status = relay_on_status,
+	.on_header_field = relay_on_header_field,
+	.on_header_value = relay_on_header_value,
+	.on_headers_complete = relay_on_headers_complete,
+	.on_body = relay_on_body,
+	.on_message_complete = relay_on_message_complete,
+};
+
+static bool relay_can_splice(struct upstream *up, struct conn *client)
+{
+	// OpenSSL needs the data in user space unless the kernel does the encryption
+	if (client->ssl && !client->ktls_send)
+		return false;
+
+	if (up->pipe_fds[0] < 0 && pipe2(up->pipe_fds, O_NONBLOCK|O_CLOEXEC) < 0) {
+		up->pipe_fds[0] = -1;
+		return false;
+	}
+	return true;
+}
+
+static bool relay_splice(struct proxy_route *route, struct upstream *up, struct conn *client, uint64_t remaining)
+{
+	while (remaining > 0) {
+		size_t len = remaining < PROXY_SPLICE_SIZE ? remaining : PROXY_SPLICE_SIZE;
+		ssize_t ret = splice(up->conn.fd, NULL, up->pipe_fds[1], NULL, len, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (ret == 0) {
+			xlog("Backend %s closed the connection mid-response", route->backend);
+			return false;
+		} else if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				if (upstream_wait(up, false, PROXY_READ_TIMEOUT_MSECS))
+					continue;
+				xlog("Backend %s timed out mid-response", route->backend);
+			} else {
+				xlog("Error while splicing from backend %s: %m", route->backend);
+			}
+			return false;
+		}
+
+		if (buf_splice(client, up->pipe_fds[0], ret) < 0)
+			return false;
+		remaining -= ret;
+	}
+
+	return true;
+}
+
+/* Finish the request and relay the response as it comes, the response head
+ * and the start of the body go through user space to find the end of the
+ * response, the rest of a body of known length is spliced.
+ */
+int proxy_request_done(struct proxy_req *req, struct conn *client, const struct http_parser *client_parser, bool *client_close)
+{
+	struct proxy_route *route = req->route;
+	struct upstream *up = req->up;
+	struct relay relay = {
+		.req = req,
+		.client = client,
+		.head = client_parser->method == HTTP_HEAD,
+		.client_keep_alive = http_should_keep_alive(client_parser),
+		.client_http10 = client_parser->http_major == 1 && client_parser->http_minor == 0,
+	};
+	char buf[PROXY_BUF_SIZE];
+	bool reuse = false;
+	int ret = -1;
+
+	if (req->chunked && buf_write(&up->conn, STR_WITH_LEN("0\r\n\r\n")) < 0) {
+		ret = 502;
+		goto out;
+	}
+
+	http_parser parser;
+	http_parser_init(&parser, HTTP_RESPONSE);
+	parser.data = &relay;
+
+	while (!relay.complete) {
+		int received = read(up->conn.fd, buf, sizeof(buf));
+		if (received < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				if (upstream_wait(up, false, PROXY_READ_TIMEOUT_MSECS))
+					continue;
+				xlog("Backend %s timed out", route->backend);
+				ret = relay.sent ? -1 : 504;
+			} else {
+				xlog("Error while reading from backend %s: %m", route->backend);
+				ret = relay.sent ? -1 : 502;
+			}
+			goto out;
+		}
+
+		size_t processed = http_parser_execute(&parser, &relay_settings, buf, received);
+		if (relay.failed) {
+			ret = relay.sent ? -1 : 502;
+			goto out;
+		}
+
+		if (received == 0) {
+			// The end of a body that runs up to EOF, the client only knows it by its own EOF
+			if (!relay.complete) {
+				xlog("Backend %s closed the connection mid-response", route->backend);
+				ret = relay.sent ? -1 : 502;
+				goto out;
+			}
+			*client_close = true;
+			relay.keep_alive = false;
+			break;
+		}
+
+		if (!relay.complete && processed != (size_t)received) {
+			xlog("Invalid response from backend %s", route->backend);
+			ret = relay.sent ? -1 : 502;
+			goto out;
+		}
+
+		if (relay.complete && processed != (size_t)received) {
+			xlog("Backend %s sent data past the response, not reusing the connection", route->backend);
+			relay.keep_alive = false;
+		}
+
+		// The head and the body so far were written by the parser callbacks
+		if (relay.headers_done && !relay.complete && relay.content_length != ULLONG_MAX &&
+				relay_can_splice(up, client)) {
+			if (!relay_splice(route, up, client, relay.content_length - relay.body_len))
+				goto out;
+			break;
+		}
+	}
+
+	if (relay.client_close)
+		*client_close = true;
+	reuse = relay.keep_alive;
+	ret = 0;
+
+out:
+	upstream_release(route, up, reuse);
+	req->route = NULL;
+	req->up = NULL;
+	return ret;
+}
+
+/* The client went away or sent garbage in the middle of the request, the
+ * backend has a partial request and can't be reused.
+ */
+void proxy_request_abort(struct proxy_req *req)
+{
+	if (req->up)
+		upstream_release(req->route, req->up, false);
+	req->route = NULL;
+	req->up = NULL;
+}
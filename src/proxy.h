@@ -0,0 +1,49 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PROXY_HEAD_SIZE 8192
+#define PROXY_CONNECTION_SIZE 256
+
+struct conn;
+struct http_parser;
+struct proxy_route;
+struct upstream;
+
+/* Requests under a configured URL prefix are forwarded to a backend over
+ * keep-alive connections pooled per route. The request and response heads are
+ * rebuilt from the parser callbacks without the hop-by-hop headers and those
+ * named in Connection, the bodies are streamed through as they come and a
+ * response body of known length is spliced from the backend socket to the
+ * client when the client isn't encrypted in user space.
+ *
+ * The functions returning an int return 0 on success, an HTTP status to answer
+ * the client with when nothing was sent to it yet or -1 when the client
+ * connection can't be used anymore.
+ */
+
+struct proxy_req {
+	struct proxy_route *route; // NULL when the request is served locally
+	struct upstream *up; // Taken once the head is complete
+	bool overflow; // The request head doesn't fit
+	bool chunked; // The request body is re-chunked to the backend
+	bool expect_continue;
+	bool in_value;
+	bool skip_value; // The current header is not forwarded
+	bool connection_value; // The current header is Connection
+	int line_start; // Offset of the current header line in the head
+	int connection_len;
+	char connection[PROXY_CONNECTION_SIZE]; // The headers named in Connection
+	int head_len;
+	char head[PROXY_HEAD_SIZE]; // The request head as it goes to the backend, then the response head
+};
+
+bool proxy_route_add(const char *spec);
+bool proxy_match(const char *url, size_t len);
+
+bool proxy_request_start(struct proxy_req *req, const struct http_parser *parser, const char *url, size_t len);
+void proxy_request_header_field(struct proxy_req *req, const char *at, size_t len);
+void proxy_request_header_value(struct proxy_req *req, const char *at, size_t len);
+int proxy_request_headers_done(struct proxy_req *req, struct conn *client, bool chunked);
+bool proxy_request_body(struct proxy_req *req, const char *at, size_t len);
+int proxy_request_done(struct proxy_req *req, struct conn *client, const struct http_parser *parser, bool *client_close);
+void proxy_request_abort(struct proxy_req *req);
@@ -0,0 +1,99 @@
+#include "state.h"
+#include "xlog.h"
+
+#include "wire_io.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define STATE_DEFAULT_DIR "/var/tmp/wire-httpd"
+
+static char state_dir[256];
+
+/* Takes the directory given on the command line, or a per-user one under
+ * /var/tmp when there is none. The directory is created private and rejected
+ * if someone else could write to it, then the state files are not kept.
+ */
+bool state_init(const char *dir)
+{
+	int len;
+
+	if (dir)
+		len = snprintf(state_dir, sizeof(state_dir), "%s", dir);
+	else
+		len = snprintf(state_dir, sizeof(state_dir), "%s-%u", STATE_DEFAULT_DIR, (unsigned)geteuid());
+	if (len >= (int)sizeof(state_dir)) {
+		fprintf(stderr, "State directory name is too long: %s\n", dir);
+		goto err;
+	}
+
+	if (mkdir(state_dir, 0700) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Failed to create the state directory %s: %m\n", state_dir);
+		goto err;
+	}
+
+	struct stat stbuf;
+	if (lstat(state_dir, &stbuf) < 0) {
+		fprintf(stderr, "Failed to check the state directory %s: %m\n", state_dir);
+		goto err;
+	}
+
+	if (!S_ISDIR(stbuf.st_mode) || stbuf.st_uid != geteuid() || (stbuf.st_mode & (S_IWGRP|S_IWOTH))) {
+		fprintf(stderr, "State directory %s must be a directory owned by the server user and not writable by others\n", state_dir);
+		goto err;
+	}
+
+	return true;
+
+err:
+	state_dir[0] = 0;
+	return false;
+}
+
+// NULL when there is no usable state directory
+const char *state_path(char *buf, size_t size, const char *name)
+{
+	if (!state_dir[0])
+		return NULL;
+
+	int len = snprintf(buf, size, "%s/%s", state_dir, name);
+	return len < (int)size ? buf : NULL;
+}
+
+/* Opens a new file for writing under a temporary name, it replaces the file
+ * called name on state_commit. The name carries the pid since during an
+ * upgrade both the old and the new server may write the same file.
+ */
+int state_create(const char *name, char *tmp_name, size_t size)
+{
+	char tmp[64];
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", name, getpid());
+	if (!state_path(tmp_name, size, tmp)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	int fd = wio_open(tmp_name, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		// Left behind by a process that died while writing and had our pid
+		unlink(tmp_name);
+		fd = wio_open(tmp_name, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+	}
+	return fd;
+}
+
+bool state_commit(const char *tmp_name, const char *name)
+{
+	char path[512];
+
+	if (!state_path(path, sizeof(path), name) || rename(tmp_name, path) < 0) {
+		xlog("Failed to rename %s into place: %m", tmp_name);
+		unlink(tmp_name);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,11 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The files the server keeps between runs (hot-set, request traces) live in a
+ * directory only the server user can write to, so that a file planted there in
+ * advance can't redirect a write.
+ */
+bool state_init(const char *dir);
+const char *state_path(char *buf, size_t size, const char *name);
+int state_create(const char *name, char *tmp_name, size_t size);
+bool state_commit(const char *tmp_name, const char *name);
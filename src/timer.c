@@ -0,0 +1,49 @@
+#include "timer.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+bool timer_start(wire_timer_t *timer, int msecs)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+	if (fd < 0) {
+		perror("Failed to create a timerfd");
+		return false;
+	}
+
+	struct itimerspec timer_val = {
+		.it_value = { .tv_sec = msecs / 1000, .tv_nsec = (msecs % 1000) * 1000000}
+	};
+
+	int ret = timerfd_settime(fd, 0, &timer_val, NULL);
+	if (ret < 0) {
+		perror("Failed to set time on timerfd");
+		close(fd);
+		return false;
+	}
+
+	timer->timerfd = fd;
+
+	wire_fd_mode_init(&timer->fd_state, fd);
+	wire_fd_mode_read(&timer->fd_state);
+
+	return true;
+}
+
+void timer_stop(wire_timer_t *timer)
+{
+	wire_fd_mode_none(&timer->fd_state);
+	close(timer->timerfd);
+}
+
+bool timer_triggered(wire_timer_t *timer)
+{
+	return timer->fd_state.wait.triggered;
+}
+
+void timer_list_chain(wire_timer_t *timer, wire_wait_list_t *list)
+{
+	wire_fd_wait_list_chain(list, &timer->fd_state);
+}
@@ -0,0 +1,13 @@
+#include "wire_fd.h"
+
+#include <stdbool.h>
+
+typedef struct wire_timer {
+	int timerfd;
+	wire_fd_state_t fd_state;
+} wire_timer_t;
+
+bool timer_start(wire_timer_t *timer, int msecs);
+void timer_stop(wire_timer_t *timer);
+bool timer_triggered(wire_timer_t *timer);
+void timer_list_chain(wire_timer_t *timer, wire_wait_list_t *list);
@@ -0,0 +1,259 @@
+#include "tls.h"
+#include "h2.h"
+#include "xlog.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef HAVE_OPENSSL
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+static SSL_CTX *ssl_ctx;
+
+static void tls_log_errors(const char *msg)
+{
+	unsigned long err;
+	char err_str[128];
+
+	while ((err = ERR_get_error()) != 0) {
+		ERR_error_string_n(err, err_str, sizeof(err_str));
+		xlog("%s: %s", msg, err_str);
+	}
+}
+
+static int tls_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+		const unsigned char *in, unsigned int inlen, void *arg)
+{
+	static const unsigned char protos_h2[] = "\x02h2\x08http/1.1";
+	static const unsigned char protos_http1[] = "\x08http/1.1";
+
+	(void)ssl;
+	(void)arg;
+
+	// Our preference order is used, h2 goes first when the client offers it
+	int ret;
+	if (h2_supported())
+		ret = SSL_select_next_proto((unsigned char **)out, outlen, protos_h2, sizeof(protos_h2) - 1, in, inlen);
+	else
+		ret = SSL_select_next_proto((unsigned char **)out, outlen, protos_http1, sizeof(protos_http1) - 1, in, inlen);
+
+	if (ret != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+bool tls_init(const char *cert_file, const char *key_file)
+{
+	ssl_ctx = SSL_CTX_new(TLS_server_method());
+	if (!ssl_ctx) {
+		tls_log_errors("Failed to create the TLS context");
+		return false;
+	}
+
+	SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_RENEGOTIATION);
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+	SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE|SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER|SSL_MODE_RELEASE_BUFFERS);
+	SSL_CTX_set_alpn_select_cb(ssl_ctx, tls_alpn_select, NULL);
+
+	if (SSL_CTX_use_certificate_chain_file(ssl_ctx, cert_file) != 1) {
+		tls_log_errors("Failed to load the certificate");
+		return false;
+	}
+
+	if (SSL_CTX_use_PrivateKey_file(ssl_ctx, key_file, SSL_FILETYPE_PEM) != 1) {
+		tls_log_errors("Failed to load the private key");
+		return false;
+	}
+
+	if (SSL_CTX_check_private_key(ssl_ctx) != 1) {
+		tls_log_errors("Private key doesn't match the certificate");
+		return false;
+	}
+
+	return true;
+}
+
+struct ssl_st *tls_new(int fd)
+{
+	SSL *ssl = SSL_new(ssl_ctx);
+	if (!ssl) {
+		tls_log_errors("Failed to create a TLS connection");
+		return NULL;
+	}
+
+	if (SSL_set_fd(ssl, fd) != 1) {
+		tls_log_errors("Failed to set the TLS connection fd");
+		SSL_free(ssl);
+		return NULL;
+	}
+
+	SSL_set_accept_state(ssl);
+	return ssl;
+}
+
+static enum tls_status tls_status(SSL *ssl, int ret)
+{
+	switch (SSL_get_error(ssl, ret)) {
+		case SSL_ERROR_WANT_READ: return TLS_WANT_READ;
+		case SSL_ERROR_WANT_WRITE: return TLS_WANT_WRITE;
+		default:
+			DEBUG("TLS error: %d", SSL_get_error(ssl, ret));
+			ERR_clear_error();
+			return TLS_ERROR;
+	}
+}
+
+enum tls_status tls_handshake(struct ssl_st *ssl)
+{
+	int ret = SSL_do_handshake(ssl);
+	if (ret == 1) {
+		DEBUG("TLS handshake done with %s, kTLS send is %s", SSL_get_cipher_name(ssl), tls_ktls_send(ssl) ? "on" : "off");
+		return TLS_DONE;
+	}
+
+	return tls_status(ssl, ret);
+}
+
+/* Same semantics as read(2), when there is nothing to read it returns -1 with
+ * errno set to EAGAIN and want_write tells if the socket needs to be writable
+ * for the read to progress.
+ */
+int tls_read(struct ssl_st *ssl, char *buf, int len, bool *want_write)
+{
+	*want_write = false;
+
+	int ret = SSL_read(ssl, buf, len);
+	if (ret > 0)
+		return ret;
+
+	int err = SSL_get_error(ssl, ret);
+	switch (err) {
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			*want_write = true;
+			/* Fall-through */
+		case SSL_ERROR_WANT_READ:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_SYSCALL:
+			ERR_clear_error();
+			if (errno == 0)
+				return 0; // Unexpected EOF
+			return -1;
+		default:
+			ERR_clear_error();
+			errno = EIO;
+			return -1;
+	}
+}
+
+// Same semantics as write(2)
+int tls_write(struct ssl_st *ssl, const char *buf, int len)
+{
+	int ret = SSL_write(ssl, buf, len);
+	if (ret > 0)
+		return ret;
+
+	switch (tls_status(ssl, ret)) {
+		case TLS_WANT_READ:
+		case TLS_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		default:
+			errno = EIO;
+			return -1;
+	}
+}
+
+/* With kTLS the kernel encrypts whatever is written to the socket so the data
+ * can bypass OpenSSL and its copies.
+ */
+bool tls_ktls_send(struct ssl_st *ssl)
+{
+	BIO *wbio = SSL_get_wbio(ssl);
+	(void)wbio; // Unused when OpenSSL is built without kTLS
+	return BIO_get_ktls_send(wbio);
+}
+
+bool tls_alpn_h2(struct ssl_st *ssl)
+{
+	const unsigned char *proto;
+	unsigned int proto_len;
+
+	SSL_get0_alpn_selected(ssl, &proto, &proto_len);
+	return proto_len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+void tls_free(struct ssl_st *ssl)
+{
+	// Best effort close notify, the socket is non-blocking
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+}
+
+#else
+
+bool tls_init(const char *cert_file, const char *key_file)
+{
+	(void)cert_file;
+	(void)key_file;
+	xlog("Built without OpenSSL, TLS is not available");
+	return false;
+}
+
+struct ssl_st *tls_new(int fd)
+{
+	(void)fd;
+	return NULL;
+}
+
+enum tls_status tls_handshake(struct ssl_st *ssl)
+{
+	(void)ssl;
+	return TLS_ERROR;
+}
+
+int tls_read(struct ssl_st *ssl, char *buf, int len, bool *want_write)
+{
+	(void)ssl;
+	(void)buf;
+	(void)len;
+	*want_write = false;
+	errno = EIO;
+	return -1;
+}
+
+int tls_write(struct ssl_st *ssl, const char *buf, int len)
+{
+	(void)ssl;
+	(void)buf;
+	(void)len;
+	errno = EIO;
+	return -1;
+}
+
+bool tls_ktls_send(struct ssl_st *ssl)
+{
+	(void)ssl;
+	return false;
+}
+
+bool tls_alpn_h2(struct ssl_st *ssl)
+{
+	(void)ssl;
+	return false;
+}
+
+void tls_free(struct ssl_st *ssl)
+{
+	(void)ssl;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#include <stdbool.h>
+
+/* The handshake and the reads are done by OpenSSL, when the kernel supports
+ * kTLS the record encryption on send is done in the kernel and the data can be
+ * written directly to the socket.
+ */
+
+struct ssl_st;
+
+enum tls_status {
+	TLS_DONE,
+	TLS_WANT_READ,
+	TLS_WANT_WRITE,
+	TLS_ERROR,
+};
+
+bool tls_init(const char *cert_file, const char *key_file);
+struct ssl_st *tls_new(int fd);
+enum tls_status tls_handshake(struct ssl_st *ssl);
+int tls_read(struct ssl_st *ssl, char *buf, int len, bool *want_write);
+int tls_write(struct ssl_st *ssl, const char *buf, int len);
+bool tls_ktls_send(struct ssl_st *ssl);
+bool tls_alpn_h2(struct ssl_st *ssl);
+void tls_free(struct ssl_st *ssl);
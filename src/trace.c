@@ -0,0 +1,287 @@
+#include "trace.h"
+#include "state.h"
+#include "xlog.h"
+
+#include "wire.h"
+#include "wire_fd.h"
+#include "wire_io.h"
+#include "wire_stack.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, req) DTRACE_PROBE2(wire_httpd, name, (req)->fd, (req)->id)
+#else
+#define TRACE_PROBE(name, req) do {} while (0)
+#endif
+
+#define TRACE_RING_SIZE 4096 // Must be a power of two
+#define TRACE_FILE "trace"
+#define TRACE_LINE_SIZE 256
+
+/* Only the owning thread writes to its ring, the head is published after the
+ * entry is written so a reader sees complete entries up to it. The rings are
+ * pushed to a global list on first use so a dump covers all threads.
+ */
+struct trace_ring {
+	struct trace_ring *next;
+	uint64_t head;
+	struct trace_req entries[TRACE_RING_SIZE];
+};
+
+static __thread struct trace_ring *ring;
+static __thread uint64_t next_id;
+static struct trace_ring *rings;
+static wire_t trace_wire;
+static char dump_buf[64*1024];
+static struct trace_req dump_entries[TRACE_RING_SIZE];
+
+static const char *phase_names[TRACE_NUM_PHASES] = {
+	[TRACE_ACCEPT] = "accept",
+	[TRACE_FIRST_READ] = "read",
+	[TRACE_PARSED] = "parsed",
+	[TRACE_CACHE_DONE] = "cache",
+	[TRACE_FIRST_WRITE] = "write_first",
+	[TRACE_LAST_WRITE] = "write_last",
+};
+
+static uint64_t trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct trace_ring *trace_ring_get(void)
+{
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return ring;
+}
+
+void trace_accept(struct trace_req *req, int fd)
+{
+	memset(req, 0, sizeof(*req));
+	req->id = ++next_id;
+	req->fd = fd;
+	req->ts[TRACE_ACCEPT] = trace_now();
+	TRACE_PROBE(accept, req);
+}
+
+/* Start tracing the next request on the same connection, it inherits the
+ * accept time of the connection.
+ */
+void trace_next(struct trace_req *req, const struct trace_req *conn)
+{
+	uint64_t accept_ts = conn->ts[TRACE_ACCEPT];
+	int fd = conn->fd;
+
+	memset(req, 0, sizeof(*req));
+	req->id = ++next_id;
+	req->fd = fd;
+	req->ts[TRACE_ACCEPT] = accept_ts;
+}
+
+void trace_mark(struct trace_req *req, enum trace_phase phase)
+{
+	// Only the first time a phase is reached counts, backend connections have no id
+	if (!req->id || req->ts[phase])
+		return;
+
+	req->ts[phase] = trace_now();
+
+	// The probe names must be literals
+	switch (phase) {
+		case TRACE_ACCEPT: TRACE_PROBE(accept, req); break;
+		case TRACE_FIRST_READ: TRACE_PROBE(read_first, req); break;
+		case TRACE_PARSED: TRACE_PROBE(parsed, req); break;
+		case TRACE_CACHE_DONE: TRACE_PROBE(cache_done, req); break;
+		case TRACE_FIRST_WRITE: TRACE_PROBE(write_first, req); break;
+		case TRACE_LAST_WRITE: TRACE_PROBE(write_last, req); break;
+		case TRACE_NUM_PHASES: break;
+	}
+}
+
+void trace_done(struct trace_req *req)
+{
+	trace_mark(req, TRACE_LAST_WRITE);
+
+	struct trace_ring *r = trace_ring_get();
+	if (r) {
+		r->entries[r->head & (TRACE_RING_SIZE - 1)] = *req;
+		__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	}
+
+	trace_next(req, req);
+}
+
+static int trace_format(char *buf, int buf_size, const struct trace_req *req)
+{
+	int len = snprintf(buf, buf_size, "%" PRIu64 " %d %" PRIu64, req->id, req->fd, req->ts[TRACE_ACCEPT]);
+	int i;
+
+	// The phases are in usecs since the accept
+	for (i = TRACE_ACCEPT + 1; i < TRACE_NUM_PHASES && len < buf_size; i++) {
+		if (req->ts[i])
+			len += snprintf(buf + len, buf_size - len, " %.1f", (req->ts[i] - req->ts[TRACE_ACCEPT]) / 1000.0);
+		else
+			len += snprintf(buf + len, buf_size - len, " -");
+	}
+
+	if (len < buf_size)
+		len += snprintf(buf + len, buf_size - len, "\n");
+	return len < buf_size ? len : buf_size;
+}
+
+/* Copy the entries of a ring still in it, the wires on this thread keep adding
+ * to the ring while the dump yields on the writes and the other threads do so
+ * anytime. Entries overwritten while they were being copied are dropped.
+ */
+static int trace_ring_copy(struct trace_ring *r, struct trace_req *entries)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	uint64_t idx;
+
+	for (idx = first; idx < head; idx++)
+		entries[idx - first] = r->entries[idx & (TRACE_RING_SIZE - 1)];
+
+	uint64_t new_head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t valid = new_head > TRACE_RING_SIZE ? new_head - TRACE_RING_SIZE : 0;
+	if (valid <= first)
+		return head - first;
+	if (valid >= head)
+		return 0;
+
+	memmove(entries, entries + (valid - first), (head - valid) * sizeof(*entries));
+	return head - valid;
+}
+
+static void trace_dump(void)
+{
+	char name[32];
+	char tmp_name[512];
+	int len = 0;
+	int i;
+
+	snprintf(name, sizeof(name), "%s.%d", TRACE_FILE, getpid());
+
+	int fd = state_create(name, tmp_name, sizeof(tmp_name));
+	if (fd < 0) {
+		xlog("Failed to open trace file %s for writing: %m", name);
+		return;
+	}
+
+	len = snprintf(dump_buf, sizeof(dump_buf), "# id fd accept_nsecs");
+	for (i = TRACE_ACCEPT + 1; i < TRACE_NUM_PHASES; i++)
+		len += snprintf(dump_buf + len, sizeof(dump_buf) - len, " %s_usecs", phase_names[i]);
+	len += snprintf(dump_buf + len, sizeof(dump_buf) - len, "\n");
+
+	off_t offset = 0;
+	struct trace_ring *r;
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		int num_entries = trace_ring_copy(r, dump_entries);
+
+		for (i = 0; i < num_entries; i++) {
+			if (sizeof(dump_buf) - len < TRACE_LINE_SIZE) {
+				if (wio_pwrite(fd, dump_buf, len, offset) != len)
+					goto err;
+				offset += len;
+				len = 0;
+			}
+			len += trace_format(dump_buf + len, TRACE_LINE_SIZE, &dump_entries[i]);
+		}
+	}
+
+	if (wio_pwrite(fd, dump_buf, len, offset) != len)
+		goto err;
+
+	wio_close(fd);
+	if (state_commit(tmp_name, name))
+		xlog("Dumped request traces to %s", state_path(tmp_name, sizeof(tmp_name), name));
+	return;
+
+err:
+	xlog("Failed to write trace file %s: %m", tmp_name);
+	wio_close(fd);
+	unlink(tmp_name);
+}
+
+static void signal_set(sigset_t *sig_set)
+{
+	sigemptyset(sig_set);
+	sigaddset(sig_set, SIGUSR2);
+}
+
+static void trace_run(void *arg)
+{
+	(void)arg;
+	sigset_t sig_set;
+
+	signal_set(&sig_set);
+	int sfd = signalfd(-1, &sig_set, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sfd < 0) {
+		xlog("Failed to create a signalfd for trace dumps: %m");
+		return;
+	}
+
+	wire_fd_state_t sfd_state;
+	wire_fd_mode_init(&sfd_state, sfd);
+	wire_fd_mode_read(&sfd_state);
+
+	while (1) {
+		wire_fd_wait(&sfd_state);
+		wire_wait_reset(&sfd_state.wait);
+
+		struct signalfd_siginfo siginfo;
+		int ret = read(sfd, &siginfo, sizeof(siginfo));
+		if (ret < 0) {
+			if (errno != EAGAIN) {
+				xlog("Error reading from signalfd: %m");
+				break;
+			}
+		} else {
+			trace_dump();
+		}
+	}
+
+	wire_fd_mode_none(&sfd_state);
+	wio_close(sfd);
+}
+
+/* Block the dump signal before any thread is created so that only the
+ * signalfd sees it.
+ */
+void trace_init(void)
+{
+	sigset_t sig_set;
+
+	signal_set(&sig_set);
+	if (pthread_sigmask(SIG_BLOCK, &sig_set, NULL) < 0)
+		xlog("Failed to block signals: %m");
+}
+
+void trace_start(void)
+{
+	wire_init(&trace_wire, "trace dump", trace_run, NULL, WIRE_STACK_ALLOC(8192));
+}
@@ -0,0 +1,31 @@
+#include <stdint.h>
+
+/* Every request records the time it reached each phase, the finished requests
+ * are kept in a per-thread ring that is dumped on SIGUSR2 to trace.<pid> in
+ * the state directory. Each phase is also a USDT probe in the
+ * wire_httpd provider for bpftrace/perf, they are a nop unless attached.
+ */
+
+enum trace_phase {
+	TRACE_ACCEPT,
+	TRACE_FIRST_READ,
+	TRACE_PARSED,
+	TRACE_CACHE_DONE,
+	TRACE_FIRST_WRITE,
+	TRACE_LAST_WRITE,
+	TRACE_NUM_PHASES
+};
+
+struct trace_req {
+	uint64_t id;
+	int fd;
+	uint64_t ts[TRACE_NUM_PHASES]; // CLOCK_MONOTONIC nsecs, 0 if not reached
+};
+
+void trace_init(void);
+void trace_start(void);
+
+void trace_accept(struct trace_req *req, int fd);
+void trace_next(struct trace_req *req, const struct trace_req *conn);
+void trace_mark(struct trace_req *req, enum trace_phase phase);
+void trace_done(struct trace_req *req);
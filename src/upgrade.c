@@ -0,0 +1,220 @@
+#include "upgrade.h"
+#include "xlog.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* A binary upgrade is done by starting the new binary with -u, it connects to
+ * the upgrade socket of the running server and gets from it the listening
+ * socket and the cache memfd. The old server then stops accepting, drains its
+ * connections and exits while the new one serves from the same cache.
+ */
+
+#define UPGRADE_MAGIC 0x57485550
+#define UPGRADE_MAX_FDS 3
+
+/* The fds are sent in the order of the upgrade_fds fields, only the ones
+ * marked in the mask are present.
+ */
+struct upgrade_msg {
+	uint32_t magic;
+	uint32_t fd_mask;
+};
+
+static socklen_t upgrade_addr(struct sockaddr_un *addr, int port)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	// Abstract socket, nothing to clean up when the process goes away
+	int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "wire-httpd-upgrade-%d", port);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+int upgrade_listen(int port)
+{
+	struct sockaddr_un addr;
+	socklen_t addr_len = upgrade_addr(&addr, port);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		xlog("Failed to create the upgrade socket: %m");
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+		xlog("Failed to bind the upgrade socket: %m");
+		close(fd);
+		return -1;
+	}
+
+	if (listen(fd, 1) < 0) {
+		xlog("Failed to listen on the upgrade socket: %m");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Accept the new server connection, only a process of the same user is
+ * allowed to take over the server.
+ */
+int upgrade_accept(int ufd)
+{
+	int cfd = accept4(ufd, NULL, NULL, SOCK_CLOEXEC);
+	if (cfd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			xlog("Failed to accept on the upgrade socket: %m");
+		return -1;
+	}
+
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+		xlog("Failed to get the upgrade peer credentials: %m");
+		close(cfd);
+		return -1;
+	}
+
+	if (cred.uid != getuid()) {
+		xlog("Refusing upgrade request from pid %d uid %d", cred.pid, cred.uid);
+		close(cfd);
+		return -1;
+	}
+
+	xlog("Handing over to pid %d", cred.pid);
+	return cfd;
+}
+
+static int *upgrade_fd_slot(struct upgrade_fds *fds, int i)
+{
+	switch (i) {
+		case 0: return &fds->listen_fd;
+		case 1: return &fds->tls_listen_fd;
+		default: return &fds->cache_fd;
+	}
+}
+
+bool upgrade_send(int cfd, const struct upgrade_fds *fds)
+{
+	struct upgrade_fds send_fds = *fds;
+	int fd_list[UPGRADE_MAX_FDS];
+	int num_fds = 0;
+	struct upgrade_msg msg = {
+		.magic = UPGRADE_MAGIC,
+	};
+	int i;
+
+	for (i = 0; i < UPGRADE_MAX_FDS; i++) {
+		int fd = *upgrade_fd_slot(&send_fds, i);
+		if (fd >= 0) {
+			fd_list[num_fds++] = fd;
+			msg.fd_mask |= 1 << i;
+		}
+	}
+
+	union {
+		char buf[CMSG_SPACE(sizeof(fd_list))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds),
+	};
+
+	memset(&control, 0, sizeof(control));
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+	memcpy(CMSG_DATA(cmsg), fd_list, sizeof(int) * num_fds);
+
+	int ret = sendmsg(cfd, &mh, MSG_NOSIGNAL);
+	close(cfd);
+	if (ret != sizeof(msg)) {
+		xlog("Failed to send the upgrade message: %m");
+		return false;
+	}
+
+	return true;
+}
+
+/* Called by the new server, fills the fds received from the old server with
+ * -1 for the ones it doesn't have.
+ */
+bool upgrade_receive(int port, struct upgrade_fds *fds)
+{
+	struct sockaddr_un addr;
+	socklen_t addr_len = upgrade_addr(&addr, port);
+	int i;
+
+	for (i = 0; i < UPGRADE_MAX_FDS; i++)
+		*upgrade_fd_slot(fds, i) = -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		xlog("Failed to create the upgrade socket: %m");
+		return false;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+		xlog("Failed to connect to the running server: %m");
+		close(fd);
+		return false;
+	}
+
+	struct upgrade_msg msg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	int ret = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+	close(fd);
+	if (ret != sizeof(msg) || msg.magic != UPGRADE_MAGIC) {
+		xlog("Invalid upgrade message received, ret=%d: %m", ret);
+		return false;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		xlog("No file descriptors in the upgrade message");
+		return false;
+	}
+
+	int fd_list[UPGRADE_MAX_FDS];
+	int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (num_fds > UPGRADE_MAX_FDS)
+		num_fds = UPGRADE_MAX_FDS;
+	memcpy(fd_list, CMSG_DATA(cmsg), sizeof(int) * num_fds);
+
+	int next = 0;
+	for (i = 0; i < UPGRADE_MAX_FDS && next < num_fds; i++) {
+		if (msg.fd_mask & (1 << i))
+			*upgrade_fd_slot(fds, i) = fd_list[next++];
+	}
+
+	if (fds->listen_fd < 0) {
+		xlog("No listening socket in the upgrade message");
+		return false;
+	}
+
+	return true;
+}
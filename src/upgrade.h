@@ -0,0 +1,12 @@
+#include <stdbool.h>
+
+struct upgrade_fds {
+	int listen_fd;
+	int tls_listen_fd;
+	int cache_fd;
+};
+
+int upgrade_listen(int port);
+int upgrade_accept(int ufd);
+bool upgrade_send(int cfd, const struct upgrade_fds *fds);
+bool upgrade_receive(int port, struct upgrade_fds *fds);
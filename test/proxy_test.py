@@ -0,0 +1,285 @@
+#!/usr/bin/env python3
+"""End to end test of the reverse proxy, run with "ninja proxy_test".
+
+A stub backend is started on a free port and wire-httpd forwards /api/ to it,
+the client side talks raw HTTP/1.1 to port 9090 so that the framing the proxy
+produces can be checked byte for byte.
+"""
+
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+PORT = 9090
+BIG_SIZE = 1024 * 1024
+
+
+class Reader:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buf = b''
+
+    def fill(self):
+        data = self.sock.recv(65536)
+        if not data:
+            raise EOFError('connection closed')
+        self.buf += data
+
+    def line(self):
+        while b'\r\n' not in self.buf:
+            self.fill()
+        line, self.buf = self.buf.split(b'\r\n', 1)
+        return line.decode('latin-1')
+
+    def exact(self, n):
+        while len(self.buf) < n:
+            self.fill()
+        data, self.buf = self.buf[:n], self.buf[n:]
+        return data
+
+    def head(self):
+        first = self.line()
+        headers = {}
+        while True:
+            line = self.line()
+            if not line:
+                return first, headers
+            name, value = line.split(':', 1)
+            headers[name.strip().lower()] = value.strip()
+
+    def chunked(self):
+        body = b''
+        while True:
+            size = int(self.line().split(';')[0], 16)
+            if size == 0:
+                while self.line():
+                    pass
+                return body
+            body += self.exact(size)
+            self.exact(2)
+
+    def body(self, headers):
+        if headers.get('transfer-encoding', '').lower() == 'chunked':
+            return self.chunked()
+        return self.exact(int(headers.get('content-length', '0')))
+
+
+class Backend:
+    """Answers /api/<what> on keep-alive connections and reports what it saw"""
+
+    def __init__(self):
+        self.listen = socket.socket()
+        self.listen.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listen.bind(('127.0.0.1', 0))
+        self.listen.listen(64)
+        self.port = self.listen.getsockname()[1]
+        self.conns = 0
+        self.lock = threading.Lock()
+        threading.Thread(target=self.accept, daemon=True).start()
+
+    def accept(self):
+        while True:
+            sock, _ = self.listen.accept()
+            with self.lock:
+                self.conns += 1
+                conn_id = self.conns
+            threading.Thread(target=self.serve, args=(sock, conn_id), daemon=True).start()
+
+    def serve(self, sock, conn_id):
+        reader = Reader(sock)
+        try:
+            while True:
+                line, headers = reader.head()
+                method, path, version = line.split(' ')
+                body = reader.body(headers)
+                if not self.respond(sock, conn_id, method, path, headers, body):
+                    break
+                if version == 'HTTP/1.0' and headers.get('connection', '').lower() != 'keep-alive':
+                    break
+        except (EOFError, OSError):
+            pass
+        sock.close()
+
+    def respond(self, sock, conn_id, method, path, headers, body):
+        def send(status, extra=b'', payload=b'', length=None):
+            if length is None:
+                length = len(payload)
+            sock.sendall(b'HTTP/1.1 ' + status + b'\r\nX-Conn: ' + str(conn_id).encode() +
+                         b'\r\nContent-Length: ' + str(length).encode() + b'\r\n' + extra + b'\r\n' + payload)
+
+        seen = b'X-Framing: ' + (b'chunked' if 'transfer-encoding' in headers else b'length') + \
+               b'\r\nX-Saw-Expect: ' + (b'yes' if 'expect' in headers else b'no') + b'\r\n'
+
+        if path == '/api/echo':
+            send(b'200 OK', seen, body)
+        elif path == '/api/hop':
+            # Headers only meant for the proxy's connection
+            send(b'200 OK', b'Connection: X-Private\r\nX-Private: secret\r\nKeep-Alive: timeout=5\r\n' +
+                 b'X-Saw-Private: ' + (b'yes' if 'x-client-private' in headers else b'no') + b'\r\n')
+        elif path == '/api/big':
+            send(b'200 OK', payload=bytes(i % 251 for i in range(BIG_SIZE)))
+        elif path == '/api/head':
+            # A HEAD response announces a body it doesn't have
+            send(b'200 OK', length=1000, payload=b'' if method == 'HEAD' else b'x' * 1000)
+        elif path == '/api/204':
+            sock.sendall(b'HTTP/1.1 204 No Content\r\nX-Conn: ' + str(conn_id).encode() + b'\r\n\r\n')
+        elif path == '/api/304':
+            sock.sendall(b'HTTP/1.1 304 Not Modified\r\nContent-Length: 1000\r\n\r\n')
+        elif path == '/api/1xx':
+            sock.sendall(b'HTTP/1.1 103 Early Hints\r\nLink: </s.css>; rel=preload\r\n\r\n')
+            send(b'200 OK', payload=b'after hints')
+        elif path == '/api/stale':
+            # Keep-alive is announced but the connection goes away right after
+            send(b'200 OK', payload=b'bye')
+            return False
+        else:
+            send(b'404 Not Found')
+        return True
+
+
+def connect():
+    sock = socket.create_connection(('127.0.0.1', PORT), timeout=10)
+    return sock, Reader(sock)
+
+
+def request(reader, sock, method, path, headers=b'', body=b''):
+    sock.sendall(method.encode() + b' ' + path.encode() + b' HTTP/1.1\r\nHost: test\r\n' + headers + b'\r\n' + body)
+    line, resp_headers = reader.head()
+    status = int(line.split(' ')[1])
+    no_body = method == 'HEAD' or status in (204, 304) or status < 200
+    return status, resp_headers, b'' if no_body else reader.body(resp_headers)
+
+
+def test_chunked(sock, reader):
+    # The parser hands over the chunks de-chunked, the proxy chunks them again
+    body = b'5;ext=1\r\nhello\r\n1\r\n \r\n5\r\nworld\r\n0\r\n\r\n'
+    status, headers, resp = request(reader, sock, 'POST', '/api/echo', b'Transfer-Encoding: chunked\r\n', body)
+    assert status == 200, status
+    assert headers['x-framing'] == 'chunked', headers
+    assert resp == b'hello world', resp
+
+
+def test_expect_continue(sock, reader):
+    sock.sendall(b'POST /api/echo HTTP/1.1\r\nHost: test\r\nContent-Length: 4\r\nExpect: 100-continue\r\n\r\n')
+    line, _ = reader.head()
+    assert line == 'HTTP/1.1 100 Continue', line
+    sock.sendall(b'ping')
+    line, headers = reader.head()
+    assert line.startswith('HTTP/1.1 200'), line
+    assert headers['x-saw-expect'] == 'no', headers
+    assert reader.body(headers) == b'ping'
+
+
+def test_splice(sock, reader):
+    status, headers, resp = request(reader, sock, 'GET', '/api/big')
+    assert status == 200, status
+    assert resp == bytes(i % 251 for i in range(BIG_SIZE)), 'body differs'
+
+
+def test_stale_retry(sock, reader):
+    status, _, resp = request(reader, sock, 'GET', '/api/stale')
+    assert (status, resp) == (200, b'bye'), (status, resp)
+    time.sleep(0.2)
+    # The pooled connection is closed by now, the request goes on a new one
+    status, _, resp = request(reader, sock, 'POST', '/api/echo', b'Content-Length: 2\r\n', b'ok')
+    assert (status, resp) == (200, b'ok'), (status, resp)
+
+
+def test_no_body(sock, reader):
+    status, headers, _ = request(reader, sock, 'HEAD', '/api/head')
+    assert status == 200 and headers['content-length'] == '1000', (status, headers)
+    status, _, _ = request(reader, sock, 'GET', '/api/204')
+    assert status == 204, status
+    status, _, _ = request(reader, sock, 'GET', '/api/304', b'If-Modified-Since: Tue, 13 May 2014 16:53:20 GMT\r\n')
+    assert status == 304, status
+    # Nothing was left behind on the connections, both sides are in sync
+    status, _, resp = request(reader, sock, 'POST', '/api/echo', b'Content-Length: 4\r\n', b'sync')
+    assert (status, resp) == (200, b'sync'), (status, resp)
+
+
+def test_1xx(sock, reader):
+    sock.sendall(b'GET /api/1xx HTTP/1.1\r\nHost: test\r\n\r\n')
+    line, headers = reader.head()
+    assert line.startswith('HTTP/1.1 103'), line
+    assert 'link' in headers, headers
+    line, headers = reader.head()
+    assert line.startswith('HTTP/1.1 200'), line
+    assert reader.body(headers) == b'after hints'
+
+
+def test_hop_by_hop(sock, reader):
+    status, headers, _ = request(reader, sock, 'GET', '/api/hop',
+                                 b'Connection: X-Client-Private\r\nX-Client-Private: secret\r\n')
+    assert status == 200, status
+    assert headers['x-saw-private'] == 'no', headers
+    assert not set(headers) & {'connection', 'keep-alive', 'x-private'}, headers
+
+
+def test_http10_pooling(sock, reader):
+    # The client closes after every request but the backend connection stays
+    seen = set()
+    for _ in range(3):
+        client, client_reader = connect()
+        client.sendall(b'GET /api/echo HTTP/1.0\r\nHost: test\r\n\r\n')
+        line, headers = client_reader.head()
+        assert line.split(' ')[1] == '200', line
+        seen.add(headers['x-conn'])
+        client.close()
+    assert len(seen) == 1, seen
+
+
+TESTS = [test_chunked, test_expect_continue, test_splice, test_stale_retry, test_no_body, test_1xx,
+         test_hop_by_hop, test_http10_pooling]
+
+
+def wait_listening(server):
+    deadline = time.time() + 10
+    while time.time() < deadline:
+        if server.poll() is not None:
+            sys.exit('wire-httpd exited with %d' % server.returncode)
+        try:
+            socket.create_connection(('127.0.0.1', PORT), timeout=1).close()
+            return
+        except OSError:
+            time.sleep(0.1)
+    sys.exit('wire-httpd is not listening on port %d' % PORT)
+
+
+def main():
+    exe = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else './wire-httpd')
+    backend = Backend()
+
+    with tempfile.TemporaryDirectory() as root:
+        server = subprocess.Popen([exe, '-p', '/api/=127.0.0.1:%d' % backend.port], cwd=root,
+                                  stdout=subprocess.DEVNULL)
+        failed = 0
+        try:
+            wait_listening(server)
+            for test in TESTS:
+                sock, reader = connect()
+                try:
+                    test(sock, reader)
+                    print('ok   %s' % test.__name__)
+                except (AssertionError, EOFError, OSError) as e:
+                    print('FAIL %s: %r' % (test.__name__, e))
+                    failed += 1
+                finally:
+                    sock.close()
+        finally:
+            server.send_signal(signal.SIGTERM)
+            try:
+                server.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                server.kill()
+
+    print('%d of %d passed' % (len(TESTS) - failed, len(TESTS)))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())